@@ -0,0 +1,159 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "jsonex.h"
+#include "jsonex_pool.h"
+
+// Every connection has one record in flight at a time. As soon as a record
+// comes out of the pool, the next one is written to the same connection, so
+// the latency is the time a record spends waiting for and going through the
+// event loop.
+
+#define RECORD "{\"id\": 12345, \"level\": \"info\", \"msg\": \"the quick brown fox\"}\n"
+
+struct connection {
+    int id;
+    int fd;
+    int sent;
+    double sent_at;
+};
+
+static const jsonex_rule_t rules[] = {
+    {
+        .type = JSONEX_INTEGER,
+        .path = (char *[]){ "id", NULL }
+    },
+    { .type = JSONEX_NONE }
+};
+static int records_per_connection = 100;
+static double *latencies;
+static size_t latencies_len;
+static size_t open_connections;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void send_record(struct connection *connection) {
+    connection->sent++;
+    connection->sent_at = now();
+    if (write(connection->fd, RECORD, sizeof(RECORD) - 1) != sizeof(RECORD) - 1) {
+        perror("write");
+        exit(1);
+    }
+}
+
+static void on_record(jsonex_pool_slot_t *slot, const char *error) {
+    struct connection *connection = slot->user;
+    if (error != NULL) {
+        printf("record: %s\n", error);
+        exit(1);
+    }
+    latencies[latencies_len++] = now() - connection->sent_at;
+    if (connection->sent < records_per_connection) {
+        send_record(connection);
+    } else {
+        close(connection->fd);
+    }
+}
+
+static void on_close(jsonex_pool_slot_t *slot, const char *error) {
+    if (error != NULL) {
+        printf("close: %s\n", error);
+        exit(1);
+    }
+    open_connections--;
+}
+
+static int compare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+    size_t connections_len = argc > 1 ? atoi(argv[1]) : 10000;
+    if (argc > 2) {
+        records_per_connection = atoi(argv[2]);
+    }
+
+    // Two descriptors per connection, plus a few for ourselves.
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur < connections_len * 2 + 16) {
+        connections_len = (limit.rlim_cur - 16) / 2;
+        printf("note: descriptor limit only allows %zu connections\n", connections_len);
+    }
+
+    jsonex_pool_slot_t *slots = malloc(connections_len * sizeof(*slots));
+    struct connection *connections = malloc(connections_len * sizeof(*connections));
+    latencies = malloc(connections_len * records_per_connection * sizeof(*latencies));
+    if (slots == NULL || connections == NULL || latencies == NULL) {
+        puts("out of memory");
+        return 1;
+    }
+
+    jsonex_ruleset_t ruleset;
+    jsonex_pool_t pool;
+    const char *ret;
+    if ((ret = jsonex_compile(&ruleset, rules)) != NULL) {
+        puts(ret);
+        return 1;
+    }
+    if ((ret = jsonex_pool_init(&pool, slots, connections_len, on_record, on_close)) != NULL) {
+        puts(ret);
+        return 1;
+    }
+
+    for (size_t i = 0; i < connections_len; i++) {
+        struct connection *connection = &connections[i];
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+            perror("socketpair");
+            return 1;
+        }
+        connection->fd = fds[1];
+        connection->sent = 0;
+        jsonex_init_ruleset(&slots[i].context, &ruleset);
+        jsonex_bind(&slots[i].context, 0, &connection->id, NULL);
+        if (jsonex_pool_add(&pool, fds[0], connection) == NULL) {
+            puts("jsonex_pool_add failed");
+            return 1;
+        }
+    }
+    open_connections = connections_len;
+
+    double start = now();
+    for (size_t i = 0; i < connections_len; i++) {
+        send_record(&connections[i]);
+    }
+    while (open_connections > 0) {
+        if ((ret = jsonex_pool_run(&pool, 1000)) != NULL) {
+            puts(ret);
+            return 1;
+        }
+    }
+    double elapsed = now() - start;
+
+    qsort(latencies, latencies_len, sizeof(*latencies), compare);
+    double bytes = (double)latencies_len * (sizeof(RECORD) - 1);
+    printf("connections: %zu\n", connections_len);
+    printf("records: %zu in %.3f s\n", latencies_len, elapsed);
+    printf("throughput: %.0f records/s, %.1f MB/s\n", latencies_len / elapsed, bytes / elapsed / 1e6);
+    printf("latency p50: %.1f us\n", latencies[latencies_len / 2] * 1e6);
+    printf("latency p99: %.1f us\n", latencies[latencies_len * 99 / 100] * 1e6);
+
+    jsonex_pool_destroy(&pool);
+    return 0;
+}
@@ -34,7 +34,11 @@ int main(void) {
     // A jsonex_context_t and jsonex_rule_t[] can be reused as many times as
     // needed, but you must call jsonex_init() on them each time.
     jsonex_context_t context;
-    jsonex_init(&context, rules);
+    const char *ret;
+    if ((ret = jsonex_init(&context, rules)) != NULL) {
+        printf("jsonex_init: %s\n", ret);
+        return 1;
+    }
 
     char input[] = "{\"a\":{\"b\":42,\"c\":\"hello there\"}}";
     for (int i = 0; i < sizeof(input) - 1; i++) {
@@ -44,7 +48,6 @@ int main(void) {
         }
     }
 
-    const char *ret;
     if ((ret = jsonex_finish(&context)) != NULL) {
         printf("jsonex_finish: %s\n", ret);
         return 1;
@@ -6,20 +6,62 @@
 #include <string.h>
 
 #include "jsonex.h"
+#include "jsonex_simd.h"
 
-int missing, found;
+#define BIT_SET(bits, i) ((bits)[(i) / 8] |= 1 << ((i) % 8))
+#define BIT_GET(bits, i) (((bits)[(i) / 8] >> ((i) % 8)) & 1)
 
 static void print_context(const char *, jsonex_context_t *);
 
+static void set_error(jsonex_context_t *context, jsonex_error_t error) {
+    // The first error is the interesting one.
+    if (context->error != JSONEX_OK) {
+        return;
+    }
+    context->error = error;
+    context->error_offset = context->offset;
+    context->error_line = 0;
+    context->error_column = 0;
+    if (context->options & JSONEX_TRACK_LINES) {
+        context->error_line = context->line;
+        context->error_column = context->offset - context->line_offset + 1;
+    }
+}
+
+// Clears the error of the last record, but not one about the rules.
+static void clear_error(jsonex_context_t *context) {
+    context->error = JSONEX_OK;
+    if (context->bad_rules) {
+        set_error(context, JSONEX_ERROR_BAD_RULES);
+    }
+}
+
+// Queues a token for jsonex_next_token(), along with the key or scalar in
+// frame.
+static void emit(jsonex_context_t *context, jsonex_token_t token, jsonex_frame_t *frame) {
+    if (!context->emit_tokens) {
+        return;
+    }
+    if (context->tokens_len == JSONEX_TOKEN_QUEUE_SIZE) {
+        set_error(context, JSONEX_ERROR_INTERNAL);
+        return;
+    }
+    context->tokens[context->tokens_len++] = token;
+    if (frame != NULL) {
+        context->token_frame.type = frame->type;
+        context->token_frame.u = frame->u;
+    }
+}
+
 static int reap(jsonex_context_t *context, jsonex_frame_t *frame_keep_type_and_value) {
     print_context("reap    ", context);
     if (context->frames_len == JSONEX_CONTEXT_FRAME_COUNT) {
-        context->error = "context full in reap()";
+        set_error(context, JSONEX_ERROR_INTERNAL);
         return 0;
     }
     jsonex_frame_t *frame = &(context->frames[context->frames_len]);
     if (frame->status != ZOMBIE) {
-        context->error = "frame isn't a zombie";
+        set_error(context, JSONEX_ERROR_INTERNAL);
         return 0;
     } else {
         frame->status = FREE;
@@ -33,11 +75,11 @@ static int reap(jsonex_context_t *context, jsonex_frame_t *frame_keep_type_and_v
 
 static void close(jsonex_context_t *context) {
     if (context->frames_len == 0) {
-        context->error = "context empty in close()";
+        set_error(context, JSONEX_ERROR_INTERNAL);
     } else {
         jsonex_frame_t *frame = &(context->frames[context->frames_len - 1]);
         if (frame->status != IN_USE) {
-            context->error = "frame isn't in use";
+            set_error(context, JSONEX_ERROR_INTERNAL);
         } else {
             frame->status = ZOMBIE;
             frame->is_complete = 1;
@@ -49,11 +91,11 @@ static void close(jsonex_context_t *context) {
 
 static void fail(jsonex_context_t *context) {
     if (context->frames_len == 0) {
-        context->error = "context empty in fail()";
+        set_error(context, JSONEX_ERROR_INTERNAL);
     } else {
         jsonex_frame_t *frame = &(context->frames[context->frames_len - 1]);
         if (frame->status != IN_USE) {
-            context->error = "frame isn't in use";
+            set_error(context, JSONEX_ERROR_INTERNAL);
         } else {
             frame->status = ZOMBIE;
             frame->is_complete = 0;
@@ -70,7 +112,7 @@ static void replace(jsonex_context_t *context, parse_fn_t fn) {
 
 static void call(jsonex_context_t *context, parse_fn_t fn) {
     if (context->frames_len == JSONEX_CONTEXT_FRAME_COUNT) {
-        context->error = "context full in call()";
+        set_error(context, JSONEX_ERROR_TOO_DEEP);
     } else {
         jsonex_frame_t *frame = &(context->frames[context->frames_len]);
         if (frame->status == FREE) {
@@ -79,7 +121,7 @@ static void call(jsonex_context_t *context, parse_fn_t fn) {
             frame->type = JSONEX_NONE;
             context->frames_len++;
         } else {
-            context->error = "frame isn't free";
+            set_error(context, JSONEX_ERROR_INTERNAL);
         }
     }
     print_context("call    ", context);
@@ -121,6 +163,7 @@ static int _null(jsonex_context_t *context, jsonex_frame_t *frame, char c) {
 
 static int value_maybe_null(jsonex_context_t *context, jsonex_frame_t *frame, char c) {
     if (reap(context, frame)) {
+        emit(context, JSONEX_TOKEN_NULL, NULL);
         close(context);
         return 0;
     } else {
@@ -133,6 +176,7 @@ static int _literal_false(jsonex_context_t *context, jsonex_frame_t *frame, char
     if (c == frame->u.literal.string[frame->u.literal.offset]) {
         frame->u.literal.offset++;
         if (frame->u.literal.offset == frame->u.literal.len) {
+            frame->u.boolean = 0;
             close(context);
         }
         return 1;
@@ -154,6 +198,7 @@ static int _false(jsonex_context_t *context, jsonex_frame_t *frame, char c) {
 
 static int value_maybe_false(jsonex_context_t *context, jsonex_frame_t *frame, char c) {
     if (reap(context, frame)) {
+        emit(context, JSONEX_TOKEN_FALSE, NULL);
         close(context);
         return 0;
     } else {
@@ -167,6 +212,7 @@ static int _literal_true(jsonex_context_t *context, jsonex_frame_t *frame, char
     if (c == frame->u.literal.string[frame->u.literal.offset]) {
         frame->u.literal.offset++;
         if (frame->u.literal.offset == frame->u.literal.len) {
+            frame->u.boolean = 1;
             close(context);
         }
         return 1;
@@ -188,6 +234,7 @@ static int _true(jsonex_context_t *context, jsonex_frame_t *frame, char c) {
 
 static int value_maybe_true(jsonex_context_t *context, jsonex_frame_t *frame, char c) {
     if (reap(context, frame)) {
+        emit(context, JSONEX_TOKEN_TRUE, NULL);
         close(context);
         return 0;
     } else {
@@ -198,6 +245,138 @@ static int value_maybe_true(jsonex_context_t *context, jsonex_frame_t *frame, ch
 }
 
 static int value(jsonex_context_t *, jsonex_frame_t *, char);
+static int object_value(jsonex_context_t *, jsonex_frame_t *, char);
+
+#define PROJECT_OPEN 1
+#define PROJECT_COMMA 2
+
+enum {
+    PROJECT_SKIP,
+    // On the way to a rule's path: write it out if it's an object or array.
+    PROJECT_CONTAINER,
+    // On a rule's path: copy it through whole.
+    PROJECT_COPY
+};
+
+static void project_flush(jsonex_context_t *context) {
+    if (context->project_len > 0) {
+        context->project_write(context, context->project_buf, context->project_len, context->project_user);
+    }
+    context->project_len = 0;
+    context->project_mark = 0;
+}
+
+static void project_out(jsonex_context_t *context, const char *s, size_t n) {
+    while (n > 0) {
+        if (context->project_len == context->project_size) {
+            // A record that may still be dropped has to stay in the buffer.
+            if (context->ruleset->filters_len > 0 || (context->options & JSONEX_RESYNC)) {
+                set_error(context, JSONEX_ERROR_OUTPUT_FULL);
+                return;
+            }
+            project_flush(context);
+        }
+        size_t room = context->project_size - context->project_len;
+        size_t k = n < room ? n : room;
+        memcpy(context->project_buf + context->project_len, s, k);
+        context->project_len += k;
+        s += k;
+        n -= k;
+    }
+}
+
+static void project_key(jsonex_context_t *context) {
+    // Keys were decoded, so escape them again, except for the backslash of
+    // a \uXXXX that was kept as it is.
+    const char *key = context->paths[context->paths_len - 1];
+    uint64_t unicode = context->paths_unicode[context->paths_len - 1];
+    project_out(context, "\"", 1);
+    for (const char *p = key; *p != '\0'; p++) {
+        if (*p == '"' || (*p == '\\' && !((unicode >> (p - key)) & 1))) {
+            project_out(context, "\\", 1);
+        } else if ((unsigned char)*p < 0x20) {
+            char escape[] = "\\u0000";
+            escape[4] = '0' + (*p >> 4);
+            escape[5] = "0123456789abcdef"[*p & 0xf];
+            project_out(context, escape, 6);
+            continue;
+        }
+        project_out(context, p, 1);
+    }
+    project_out(context, "\":", 2);
+}
+
+static int project_role(jsonex_context_t *context) {
+    const jsonex_ruleset_t *ruleset = context->ruleset;
+    int role = PROJECT_SKIP;
+    for (int r = 0; r < ruleset->rules_len; r++) {
+        if (ruleset->depth[r] < context->paths_len) {
+            continue;
+        }
+        int match = 1;
+        for (int i = 0; i < context->paths_len; i++) {
+            if (strcmp(ruleset->rules[r].path[i], context->paths[i])) {
+                match = 0;
+                break;
+            }
+        }
+        if (match && ruleset->depth[r] == context->paths_len) {
+            return PROJECT_COPY;
+        } else if (match) {
+            role = PROJECT_CONTAINER;
+        }
+    }
+    return role;
+}
+
+// Called with the first character of every value, unless it is inside one
+// that's being copied through.
+static void project_value(jsonex_context_t *context, jsonex_frame_t *frame, char c) {
+    size_t k = frame - context->frames;
+    if (k + 1 < JSONEX_CONTEXT_FRAME_COUNT) {
+        context->project_state[k + 1] = 0;
+    }
+
+    int role = PROJECT_CONTAINER;
+    int member = k > 0 && context->frames[k - 1].fn == object_value;
+    if (k > 0 && !(context->project_state[k - 1] & PROJECT_OPEN)) {
+        return;
+    } else if (member) {
+        role = project_role(context);
+    }
+    if (role == PROJECT_SKIP || (role == PROJECT_CONTAINER && c != '{' && c != '[')) {
+        // Array items that are neither are dropped too.
+        return;
+    }
+
+    if (k > 0) {
+        if (context->project_state[k - 1] & PROJECT_COMMA) {
+            project_out(context, ",", 1);
+        }
+        context->project_state[k - 1] |= PROJECT_COMMA;
+        if (member) {
+            project_key(context);
+        }
+    }
+    if (role == PROJECT_COPY) {
+        // jsonex_call() and jsonex_feed() copy the characters from here on.
+        context->project_copying = 1;
+        context->project_copy_frame = k;
+    } else if (k + 1 < JSONEX_CONTEXT_FRAME_COUNT) {
+        project_out(context, &c, 1);
+        context->project_state[k + 1] = PROJECT_OPEN;
+    }
+}
+
+// Called just before the object or array in the top frame closes with c.
+static void container_close(jsonex_context_t *context, char c) {
+    size_t k = context->frames_len - 1;
+    if (!context->project_copying && (context->project_state[k] & PROJECT_OPEN)) {
+        project_out(context, &c, 1);
+        context->project_state[k] = 0;
+    }
+    emit(context, c == '}' ? JSONEX_TOKEN_END_OBJECT : JSONEX_TOKEN_END_ARRAY, NULL);
+}
 
 static int array_item(jsonex_context_t *context, jsonex_frame_t *frame, char c) {
     if (is_ws(c)) {
@@ -209,6 +388,7 @@ static int array_item(jsonex_context_t *context, jsonex_frame_t *frame, char c)
             call(context, value);
             return 1;
         } else if (c == ']') {
+            container_close(context, c);
             close(context);
             return 1;
         }
@@ -221,6 +401,7 @@ static int array_item(jsonex_context_t *context, jsonex_frame_t *frame, char c)
 static int array_maybe_empty(jsonex_context_t *context, jsonex_frame_t *frame, char c) {
     if (c == ']') {
         // The empty array.
+        container_close(context, c);
         close(context);
         return 1;
     } else if (c == '\0') {
@@ -235,6 +416,7 @@ static int array_maybe_empty(jsonex_context_t *context, jsonex_frame_t *frame, c
 
 static int array(jsonex_context_t *context, jsonex_frame_t *frame, char c) {
     if (c == '[') {
+        emit(context, JSONEX_TOKEN_BEGIN_ARRAY, NULL);
         replace(context, array_maybe_empty);
         return 1;
     }
@@ -256,32 +438,266 @@ static int value_maybe_array(jsonex_context_t *context, jsonex_frame_t *frame, c
 
 static int object_key(jsonex_context_t *, jsonex_frame_t *, char);
 
-static void *match_rule(jsonex_context_t *context, jsonex_type_t type) {
-    for (jsonex_rule_t *p = context->rules; p->type != JSONEX_NONE; p++) {
-        if (p->type != type) {
+// JSONEX_NONE matches rules of any type.
+static int match_path(jsonex_context_t *context, jsonex_type_t type) {
+    const jsonex_ruleset_t *ruleset = context->ruleset;
+    for (int r = 0; r < ruleset->rules_len; r++) {
+        const jsonex_rule_t *p = &ruleset->rules[r];
+        if ((type != JSONEX_NONE && p->type != type) || ruleset->depth[r] != context->paths_len) {
             continue;
         }
         int match = 1;
         for (int i = 0; i < context->paths_len; i++) {
-            if (p->path[i] == NULL) {
-                match = 0;
-                break;
-            }
             if (strcmp(p->path[i], context->paths[i])) {
                 match = 0;
                 break;
             }
         }
         if (match) {
-            if (p->found == &missing) {
-                p->found = &found;
-            } else if (p->found != &found) {
-                *(p->found) = 1;
+            return r;
+        }
+    }
+    return -1;
+}
+
+static void set_found(jsonex_context_t *context, int r) {
+    BIT_SET(context->found, r);
+    if (context->bindings[r].found != NULL) {
+        *(context->bindings[r].found) = 1;
+    }
+}
+
+static int may_match(jsonex_context_t *context) {
+    // A key learned by JSONEX_PREDICT_KEYS already knows whether any rule
+    // has its path.
+    if (!(context->options & JSONEX_PREDICT_KEYS)) {
+        return 1;
+    }
+    int pos = context->shape_member[context->paths_len - 1];
+    return pos < 0 || context->shape_rule[pos] >= 0;
+}
+
+static int match_rule(jsonex_context_t *context, jsonex_type_t type) {
+    int r = match_path(context, type);
+    if (r >= 0) {
+        set_found(context, r);
+    }
+    return r;
+}
+
+static int number_value(const jsonex_frame_t *frame) {
+    if (frame->u.number.negative) {
+        return -frame->u.number.integer_part;
+    }
+    return frame->u.number.integer_part;
+}
+
+static int filter_accepts(const jsonex_rule_t *rule, jsonex_frame_t *frame) {
+    switch (rule->filter) {
+    case JSONEX_FILTER_NONE:
+        return 1;
+    case JSONEX_FILTER_EQUALS:
+        return rule->type == JSONEX_STRING &&
+            strcmp(frame->u.string, rule->filter_string) == 0;
+    case JSONEX_FILTER_PREFIX:
+        return rule->type == JSONEX_STRING &&
+            strncmp(frame->u.string, rule->filter_string, strlen(rule->filter_string)) == 0;
+    case JSONEX_FILTER_RANGE:
+        return rule->type == JSONEX_INTEGER &&
+            number_value(frame) >= rule->filter_min &&
+            number_value(frame) <= rule->filter_max;
+    }
+    return 0;
+}
+
+static int object_value(jsonex_context_t *, jsonex_frame_t *, char);
+
+static void reject(jsonex_context_t *context) {
+    // Every open object or array has exactly one frame waiting on its current
+    // member, so counting those tells us how many brackets are left to close.
+    context->skip_depth = 0;
+    for (int i = 0; i < context->frames_len; i++) {
+        if (context->frames[i].fn == object_value || context->frames[i].fn == array_item) {
+            context->skip_depth++;
+        }
+    }
+    for (int i = 0; i < JSONEX_CONTEXT_FRAME_COUNT; i++) {
+        context->frames[i].status = FREE;
+    }
+    context->frames_len = 0;
+    context->rejected = 1;
+    context->project_copying = 0;
+    context->project_len = context->project_mark;
+    context->skip_in_string = 0;
+    context->skip_escape = 0;
+    print_context("reject  ", context);
+}
+
+static void batch_store(jsonex_context_t *context, int r, jsonex_frame_t *frame) {
+    jsonex_batch_t *batch = context->batch;
+    jsonex_column_t *column = &batch->columns[r];
+    size_t row = batch->rows;
+    if (row == batch->capacity) {
+        return;
+    }
+
+    switch (context->ruleset->rules[r].type) {
+    case JSONEX_INTEGER:
+    case JSONEX_BOOL:
+        if (column->values != NULL) {
+            column->values[row] = frame->type == JSONEX_INTEGER ?
+                number_value(frame) : frame->u.boolean;
+        }
+        break;
+    case JSONEX_STRING:
+        if (column->offsets != NULL) {
+            // Starting from the row's offset, rather than the end of the data,
+            // overwrites a repeated key.
+            if (row == 0) {
+                column->offsets[0] = 0;
             }
-            return p->p;
+            size_t len = strlen(frame->u.string);
+            // jsonex_feed() stops while there is room for any string, but
+            // jsonex_call() and jsonex_finish() carry on regardless.
+            if (column->offsets[row] + len > column->data_size) {
+                set_error(context, JSONEX_ERROR_OUTPUT_FULL);
+                return;
+            }
+            memcpy(column->data + column->offsets[row], frame->u.string, len);
+            column->offsets[row + 1] = column->offsets[row] + len;
         }
+        break;
+    case JSONEX_STREAM:
+    case JSONEX_NONE:
+        break;
     }
-    return NULL;
+}
+
+static void store(jsonex_context_t *context, int r, jsonex_frame_t *frame) {
+    if (context->batch != NULL) {
+        batch_store(context, r, frame);
+        return;
+    }
+
+    void *p = context->bindings[r].p;
+    switch (p == NULL ? JSONEX_NONE : frame->type) {
+    case JSONEX_INTEGER:
+        *((int *)p) = number_value(frame);
+        break;
+    case JSONEX_STRING:
+        strcpy(p, frame->u.string);
+        break;
+    case JSONEX_BOOL:
+        *((int *)p) = frame->u.boolean;
+        break;
+    case JSONEX_STREAM:
+    case JSONEX_NONE:
+        // Filter-only or unbound rule, there is nowhere to store the value.
+        break;
+    }
+}
+
+static void stream_flush(jsonex_context_t *context, jsonex_stream_t *stream) {
+    if (context->stream_len > 0) {
+        stream->write(context, context->stream_buf, context->stream_len, stream->user);
+        context->stream_len = 0;
+    }
+}
+
+static void stream_put(jsonex_context_t *context, jsonex_stream_t *stream, const char *s, size_t n) {
+    while (n > 0) {
+        size_t room = sizeof(context->stream_buf) - context->stream_len;
+        size_t k = n < room ? n : room;
+        memcpy(context->stream_buf + context->stream_len, s, k);
+        context->stream_len += k;
+        s += k;
+        n -= k;
+        if (context->stream_len == sizeof(context->stream_buf)) {
+            stream_flush(context, stream);
+        }
+    }
+}
+
+static void stream_bytes(jsonex_context_t *context, jsonex_stream_t *stream, uint32_t bits, int n) {
+    char bytes[3] = { (char)(bits >> 16), (char)(bits >> 8), (char)bits };
+    stream_put(context, stream, bytes, n);
+}
+
+// Takes decoded string contents, the same as string_append().
+static void stream_append(jsonex_context_t *context, const char *s, size_t n) {
+    jsonex_stream_t *stream = context->bindings[context->stream_rule].p;
+    if (stream == NULL) {
+        return;
+    } else if (!stream->base64) {
+        stream_put(context, stream, s, n);
+        return;
+    }
+
+    const unsigned char *u = (const unsigned char *)s;
+    jsonex_base64_fn_t decode = context->decode_base64;
+    size_t i = 0;
+    while (i < n) {
+        // Whole groups of four go through the SIMD kernel, as long as they
+        // are all in the alphabet, a chunk's worth at a time.
+        if (context->stream_sextets == 0 && i + 4 <= n) {
+            char bytes[JSONEX_STREAM_CHUNK_SIZE + JSONEX_BASE64_SLACK];
+            size_t k = n - i < JSONEX_STREAM_CHUNK_SIZE / 3 * 4 ? n - i : JSONEX_STREAM_CHUNK_SIZE / 3 * 4;
+            size_t decoded = decode(s + i, k, bytes);
+            if (decoded > 0) {
+                stream_put(context, stream, bytes, decoded / 4 * 3);
+                i += decoded;
+                continue;
+            }
+        }
+
+        unsigned char v = jsonex_base64_values[u[i++]];
+        if (v == JSONEX_BASE64_SKIP) {
+            continue;
+        } else if (v == JSONEX_BASE64_BAD) {
+            // Point the error at the character itself, when s is a run of
+            // the input rather than a decoded escape.
+            context->offset += i - 1;
+            set_error(context, JSONEX_ERROR_BAD_BASE64);
+            context->offset -= i - 1;
+            return;
+        }
+        context->stream_bits = context->stream_bits << 6 | v;
+        if (++context->stream_sextets == 4) {
+            stream_bytes(context, stream, context->stream_bits, 3);
+            context->stream_bits = 0;
+            context->stream_sextets = 0;
+        }
+    }
+}
+
+static void stream_end(jsonex_context_t *context, jsonex_frame_t *frame) {
+    int r = context->stream_rule;
+    jsonex_stream_t *stream = context->bindings[r].p;
+    context->stream_rule = -1;
+    if (frame->type != JSONEX_STRING) {
+        return;
+    }
+
+    if (stream != NULL) {
+        if (stream->base64) {
+            // Two leftover sextets make a byte, three make two.
+            uint32_t bits = context->stream_bits;
+            switch (context->stream_sextets) {
+            case 1:
+                set_error(context, JSONEX_ERROR_BAD_BASE64);
+                return;
+            case 2:
+                stream_bytes(context, stream, bits << 12, 1);
+                break;
+            case 3:
+                stream_bytes(context, stream, bits << 6, 2);
+                break;
+            }
+        }
+        stream_flush(context, stream);
+        stream->write(context, NULL, 0, stream->user);
+    }
+    set_found(context, r);
 }
 
 static int object_value(jsonex_context_t *context, jsonex_frame_t *frame, char c) {
@@ -291,38 +707,42 @@ static int object_value(jsonex_context_t *context, jsonex_frame_t *frame, char c
 
     if (reap(context, NULL)) {
         jsonex_frame_t *reaped_frame = &(context->frames[context->frames_len]);
-        if (reaped_frame->type != JSONEX_NONE) {
-            void *p;
-            if ((p = match_rule(context, reaped_frame->type)) != NULL) {
-                switch (reaped_frame->type) {
-                case JSONEX_INTEGER:
-                    *((int *)p) = reaped_frame->u.number.integer_part;
-                    break;
-                case JSONEX_STRING:
-                    strcpy(p, reaped_frame->u.string);
-                    break;
-                case JSONEX_BOOL:
-                    *((int *)p) = reaped_frame->u.boolean;
-                    break;
-                case JSONEX_NONE:
-                    context->error = "got JSONEX_NONE while reap()ing a value";
-                    fail(context);
+        if (context->stream_rule >= 0) {
+            stream_end(context, reaped_frame);
+        }
+        if (context->project_copying && context->project_copy_frame == context->frames_len) {
+            context->project_copying = 0;
+        }
+        if (reaped_frame->type != JSONEX_NONE && may_match(context)) {
+            int r;
+            if ((r = match_rule(context, reaped_frame->type)) >= 0) {
+                if (!filter_accepts(&context->ruleset->rules[r], reaped_frame)) {
+                    // Nothing else in this record is of interest. Whatever
+                    // hasn't been extracted yet is left untouched.
+                    reject(context);
                     return 0;
                 }
+                store(context, r, reaped_frame);
             }
         }
 
+        if (context->index_fn != NULL && context->paths_len == context->index_depth) {
+            context->index_fn(context, context->index_start,
+                context->offset - context->index_start, context->index_user);
+        }
+
         // Remove last path component.
         if (context->paths_len > 0) {
             context->paths_len--;
         } else {
-            context->error = "path_lens == 0 in object_value";
+            set_error(context, JSONEX_ERROR_INTERNAL);
         }
 
         if (c == ',') {
             replace(context, object_key);
             return 1;
         } else if (c == '}') {
+            container_close(context, c);
             close(context);
             return 1;
         }
@@ -332,6 +752,43 @@ static int object_value(jsonex_context_t *context, jsonex_frame_t *frame, char c
     return 0;
 }
 
+static void learn_key(jsonex_context_t *context) {
+    size_t pos = context->shape_pos++;
+    size_t depth = context->paths_len - 1;
+    const char *key = context->paths[depth];
+    size_t len = strlen(key);
+    context->shape_member[depth] = -1;
+    if (context->shape_predicted) {
+        context->shape_predicted = 0;
+        context->shape_member[depth] = pos;
+        return;
+    }
+    // Past a key that couldn't be learned, nothing more is in this record.
+    if (pos > context->shape_len || pos >= JSONEX_SHAPE_KEYS) {
+        return;
+    }
+
+    size_t start = context->shape_offsets[pos];
+    if (pos < context->shape_len && context->shape_depth[pos] == depth &&
+            context->shape_offsets[pos + 1] - start == len &&
+            memcmp(context->shape_keys + start, key, len) == 0) {
+        context->shape_member[depth] = pos;
+        return;
+    }
+
+    // The record went another way, so forget the rest of the last one.
+    context->shape_len = pos;
+    if (start + len > JSONEX_SHAPE_SIZE || context->string_escaped) {
+        return;
+    }
+    memcpy(context->shape_keys + start, key, len);
+    context->shape_offsets[pos + 1] = start + len;
+    context->shape_depth[pos] = depth;
+    context->shape_rule[pos] = match_path(context, JSONEX_NONE);
+    context->shape_len = pos + 1;
+    context->shape_member[depth] = pos;
+}
+
 static int object_colon(jsonex_context_t *context, jsonex_frame_t *frame, char c) {
     if (is_ws(c)) {
         return 1;
@@ -341,10 +798,25 @@ static int object_colon(jsonex_context_t *context, jsonex_frame_t *frame, char c
         jsonex_frame_t *frame = &(context->frames[context->frames_len]);
 
         // Add key to path.
-        strcpy(context->paths[context->paths_len++], frame->u.string);
+        strcpy(context->paths[context->paths_len], frame->u.string);
+        context->paths_unicode[context->paths_len++] = context->string_unicode;
+        if (context->options & JSONEX_PREDICT_KEYS) {
+            learn_key(context);
+        }
+        emit(context, JSONEX_TOKEN_KEY, frame);
 
         replace(context, object_value);
         call(context, value);
+
+        // If the value is a string, it will be in the frame above the
+        // value's.
+        if (context->ruleset->streams_len > 0 &&
+                (context->stream_rule = match_path(context, JSONEX_STREAM)) >= 0) {
+            context->stream_frame = context->frames_len;
+            context->stream_bits = 0;
+            context->stream_sextets = 0;
+            context->stream_len = 0;
+        }
         return 1;
     }
 
@@ -359,6 +831,10 @@ static int object_key(jsonex_context_t *context, jsonex_frame_t *frame, char c)
         return 1;
     }
 
+    if (context->paths_len + 1 == context->index_depth) {
+        context->index_start = context->offset;
+    }
+
     replace(context, object_colon);
     call(context, string);
     return 0;
@@ -371,6 +847,7 @@ static int object_maybe_empty(jsonex_context_t *context, jsonex_frame_t *frame,
 
     if (c == '}') {
         // The empty object.
+        container_close(context, c);
         close(context);
         return 1;
     } else if (c == '\0') {
@@ -384,6 +861,7 @@ static int object_maybe_empty(jsonex_context_t *context, jsonex_frame_t *frame,
 
 static int object(jsonex_context_t *context, jsonex_frame_t *frame, char c) {
     if (c == '{') {
+        emit(context, JSONEX_TOKEN_BEGIN_OBJECT, NULL);
         replace(context, object_maybe_empty);
         return 1;
     }
@@ -483,6 +961,7 @@ static int number(jsonex_context_t *context, jsonex_frame_t *frame, char c) {
 
 static int value_maybe_number(jsonex_context_t *context, jsonex_frame_t *frame, char c) {
     if (reap(context, frame)) {
+        emit(context, JSONEX_TOKEN_NUMBER, frame);
         close(context);
         return 0;
     } else {
@@ -492,21 +971,98 @@ static int value_maybe_number(jsonex_context_t *context, jsonex_frame_t *frame,
     }
 }
 
+static size_t string_room(jsonex_frame_t *frame) {
+    // Keep room for the terminating '\0'.
+    return sizeof(frame->u.string) - 1 - strlen(frame->u.string);
+}
+
+static int streaming(jsonex_context_t *context, jsonex_frame_t *frame) {
+    return context->stream_rule >= 0 && frame == &context->frames[context->stream_frame];
+}
+
+// Whether all of the string is needed: keys become path components, the
+// cursor hands out every string, and a member's value may be stored by a
+// rule. Any other string can lose what doesn't fit.
+static int string_kept(jsonex_context_t *context, jsonex_frame_t *frame) {
+    if (context->emit_tokens || frame[-1].fn == object_colon) {
+        return 1;
+    }
+    return frame - context->frames >= 2 && frame[-2].fn == object_value &&
+        match_path(context, JSONEX_STRING) >= 0;
+}
+
+static void string_append(jsonex_context_t *context, jsonex_frame_t *frame, const char *s, size_t n) {
+    if (streaming(context, frame)) {
+        stream_append(context, s, n);
+        return;
+    }
+
+    size_t len = strlen(frame->u.string);
+    size_t room = string_room(frame);
+    if (n > room) {
+        if (string_kept(context, frame)) {
+            set_error(context, JSONEX_ERROR_STRING_TOO_LONG);
+        }
+        n = room;
+    }
+    memcpy(frame->u.string + len, s, n);
+}
+
+static int string_contents(jsonex_context_t *, jsonex_frame_t *, char);
+
+static int string_escape(jsonex_context_t *context, jsonex_frame_t *frame, char c) {
+    char decoded;
+    context->string_escaped = 1;
+    switch (c) {
+    case '"':
+    case '\\':
+    case '/':
+        decoded = c;
+        break;
+    case 'b':
+        decoded = '\b';
+        break;
+    case 'f':
+        decoded = '\f';
+        break;
+    case 'n':
+        decoded = '\n';
+        break;
+    case 'r':
+        decoded = '\r';
+        break;
+    case 't':
+        decoded = '\t';
+        break;
+    case 'u':
+        // \uXXXX is kept as it is, the hex digits follow as usual.
+        context->string_unicode |= (uint64_t)1 << strlen(frame->u.string);
+        string_append(context, frame, "\\u", 2);
+        replace(context, string_contents);
+        return 1;
+    default:
+        fail(context);
+        return 0;
+    }
+
+    string_append(context, frame, &decoded, 1);
+    replace(context, string_contents);
+    return 1;
+}
+
 static int string_contents(jsonex_context_t *context, jsonex_frame_t *frame, char c) {
     if (c == '"') {
         close(context);
         return 1;
+    } else if (c == '\\') {
+        replace(context, string_escape);
+        return 1;
     } else if (c == '\0') {
         fail(context);
         return 0;
     } else {
         // Add to buffer and consume.
-        size_t len = strlen(frame->u.string);
-        if (len < sizeof(frame->u.string)) {
-            frame->u.string[strlen(frame->u.string)] = c;
-        } else {
-            context->error = "string too long in string_contents";
-        }
+        string_append(context, frame, &c, 1);
         return 1;
     }
 }
@@ -514,6 +1070,8 @@ static int string_contents(jsonex_context_t *context, jsonex_frame_t *frame, cha
 static int string(jsonex_context_t *context, jsonex_frame_t *frame, char c) {
     memset(frame->u.string, '\0', sizeof(frame->u.string));
     frame->type = JSONEX_STRING;
+    context->string_escaped = 0;
+    context->string_unicode = 0;
 
     if (c == '"') {
         replace(context, string_contents);
@@ -529,6 +1087,7 @@ static int string(jsonex_context_t *context, jsonex_frame_t *frame, char c) {
 
 static int value_maybe_string(jsonex_context_t *context, jsonex_frame_t *frame, char c) {
     if (reap(context, frame)) {
+        emit(context, JSONEX_TOKEN_STRING, frame);
         close(context);
         return 0;
     } else {
@@ -543,6 +1102,13 @@ static int value(jsonex_context_t *context, jsonex_frame_t *frame, char c) {
         return 1;
     }
 
+    if (frame == &context->frames[0]) {
+        context->index_start = context->offset;
+    }
+    if (context->project_write != NULL && !context->project_copying) {
+        project_value(context, frame, c);
+    }
+
     replace(context, value_maybe_string);
     call(context, string);
     return 0;
@@ -552,8 +1118,8 @@ static void print_context(const char *msg, jsonex_context_t *context) {
 #if DEBUG
     printf("%s ", msg);
 
-    if (context->error != NULL) {
-        printf("ERROR! %s\n", context->error);
+    if (context->error == JSONEX_ERROR_INTERNAL) {
+        printf("ERROR! %s\n", jsonex_strerror(context->error));
         exit(1);
     }
 
@@ -595,6 +1161,7 @@ static void print_context(const char *msg, jsonex_context_t *context) {
         FN(number_got_sign)
         FN(number)
         FN(value_maybe_number)
+        FN(string_escape)
         FN(string_contents)
         FN(string)
         FN(value_maybe_string)
@@ -607,7 +1174,7 @@ static void print_context(const char *msg, jsonex_context_t *context) {
 #endif
 }
 
-void jsonex_init(jsonex_context_t *context, jsonex_rule_t *rules) {
+static void reset(jsonex_context_t *context) {
     context->frames[0].status = IN_USE;
     context->frames[0].fn = value;
     context->frames[0].type = JSONEX_NONE;
@@ -616,18 +1183,444 @@ void jsonex_init(jsonex_context_t *context, jsonex_rule_t *rules) {
     }
     context->frames_len = 1;
     context->paths_len = 0;
-    for (jsonex_rule_t *p = rules; p->type != JSONEX_NONE; p++) {
-        if (p->found == NULL || p->found == &found) {
-            p->found = &missing;
+    memset(context->found, 0, sizeof(context->found));
+    for (int r = 0; r < context->ruleset->rules_len; r++) {
+        if (context->bindings[r].found != NULL) {
+            *(context->bindings[r].found) = 0;
+        }
+    }
+    context->rejected = 0;
+    context->in_member = 0;
+    context->skip_depth = 0;
+    context->skip_in_string = 0;
+    context->skip_escape = 0;
+    context->resyncing = 0;
+    context->stream_rule = -1;
+    context->project_copying = 0;
+    context->project_mark = context->project_len;
+    memset(context->project_state, 0, sizeof(context->project_state));
+    context->shape_pos = 0;
+    context->shape_predicted = 0;
+    context->tokens_len = 0;
+    context->skipping_value = 0;
+    clear_error(context);
+}
+
+static void restart(jsonex_context_t *context) {
+    context->offset = 0;
+    context->line = 1;
+    context->line_offset = 0;
+    context->records = 0;
+    reset(context);
+}
+
+static void advance(jsonex_context_t *context, const char *s, size_t n) {
+    if (context->options & JSONEX_TRACK_LINES) {
+        const char *p = s, *newline;
+        while ((newline = memchr(p, '\n', n - (p - s))) != NULL) {
+            context->line++;
+            context->line_offset = context->offset + (newline - s) + 1;
+            p = newline + 1;
+        }
+    }
+    context->offset += n;
+}
+
+static void check_rules(jsonex_context_t *context) {
+    // If there was any required rule that was not found, then that's an error.
+    const jsonex_ruleset_t *ruleset = context->ruleset;
+    for (int r = 0; r < ruleset->rules_len; r++) {
+        if (BIT_GET(ruleset->required, r) && !BIT_GET(context->found, r)) {
+            set_error(context, JSONEX_ERROR_MISSING_RULE);
+            return;
+        }
+    }
+}
+
+static void index_record(jsonex_context_t *context) {
+    if (context->index_fn != NULL && context->index_depth == 0 &&
+            (context->error == JSONEX_OK || context->error == JSONEX_ERROR_MISSING_RULE)) {
+        context->index_fn(context, context->index_start,
+            context->offset - context->index_start, context->index_user);
+    }
+}
+
+static void end_record(jsonex_context_t *context) {
+    const char *error = NULL;
+    if (context->error != JSONEX_OK) {
+        error = jsonex_strerror(context->error);
+    }
+    index_record(context);
+    if (context->project_write != NULL) {
+        if (context->error == JSONEX_OK) {
+            project_out(context, "\n", 1);
+            project_flush(context);
         } else {
-            *(p->found) = 0;
+            context->project_len = context->project_mark;
         }
     }
-    context->rules = rules;
-    context->error = NULL;
+    context->record_fn(context, error, context->record_user);
+    context->records++;
+    reset(context);
 }
 
-int jsonex_call(jsonex_context_t *context, char c) {
+static void skip_end(jsonex_context_t *context) {
+    if (context->record_fn != NULL && !context->in_member) {
+        // Rejected records are dropped silently.
+        context->records++;
+        reset(context);
+    }
+}
+
+static void skip_done(jsonex_context_t *context) {
+    if (context->skipping_value) {
+        // The object or array that was skipped is in the top frame.
+        context->skipping_value = 0;
+        close(context);
+    } else {
+        skip_end(context);
+    }
+}
+
+static int skip(jsonex_context_t *context, char c) {
+    if (context->skip_in_string) {
+        if (context->skip_escape) {
+            context->skip_escape = 0;
+        } else if (c == '\\') {
+            context->skip_escape = 1;
+        } else if (c == '"') {
+            context->skip_in_string = 0;
+        }
+        return 1;
+    }
+
+    // Outside strings too, a backslash keeps the next quote from counting,
+    // as it does for skip_block(); brackets count either way.
+    int escaped = context->skip_escape;
+    context->skip_escape = !escaped && c == '\\';
+    if (escaped && c == '"') {
+        return 1;
+    }
+
+    switch (c) {
+    case '"':
+        context->skip_in_string = 1;
+        break;
+    case '{':
+    case '[':
+        context->skip_depth++;
+        break;
+    case '}':
+    case ']':
+        if (--context->skip_depth == 0) {
+            skip_done(context);
+        }
+        break;
+    }
+    return 1;
+}
+
+// Skips through a whole block at once, returning how many bytes of it were
+// part of the rejected record.
+static size_t skip_block(jsonex_context_t *context, const char *block, jsonex_masks_t *masks) {
+    uint64_t escaped = context->skip_escape;
+    uint64_t in_string = context->skip_in_string;
+    uint64_t strings = jsonex_strings(masks, &escaped, &in_string);
+    uint64_t structural = masks->structural & ~strings;
+    while (structural) {
+        int i = jsonex_first_bit(structural);
+        structural &= structural - 1;
+        switch (block[i]) {
+        case '{':
+        case '[':
+            context->skip_depth++;
+            break;
+        case '}':
+        case ']':
+            if (--context->skip_depth == 0) {
+                skip_done(context);
+                return i + 1;
+            }
+            break;
+        }
+    }
+    context->skip_escape = escaped;
+    context->skip_in_string = in_string;
+    return 64;
+}
+
+const char *jsonex_compile(jsonex_ruleset_t *ruleset, const jsonex_rule_t *rules) {
+    ruleset->rules = rules;
+    ruleset->rules_len = 0;
+    ruleset->streams_len = 0;
+    ruleset->filters_len = 0;
+    memset(ruleset->required, 0, sizeof(ruleset->required));
+
+    for (const jsonex_rule_t *p = rules; p->type != JSONEX_NONE; p++) {
+        size_t r = ruleset->rules_len;
+        if (r == JSONEX_MAX_RULES) {
+            return "more than JSONEX_MAX_RULES rules";
+        }
+
+        size_t depth = 0;
+        while (p->path[depth] != NULL) {
+            if (strlen(p->path[depth]) >= JSONEX_MAX_STRING_SIZE) {
+                return "path component longer than JSONEX_MAX_STRING_SIZE";
+            }
+            depth++;
+        }
+        // Every level of nesting takes at least two frames.
+        if (depth == 0 || depth > JSONEX_CONTEXT_FRAME_COUNT / 2) {
+            return "path can never match";
+        }
+
+        switch (p->filter) {
+        case JSONEX_FILTER_NONE:
+            break;
+        case JSONEX_FILTER_EQUALS:
+        case JSONEX_FILTER_PREFIX:
+            if (p->type != JSONEX_STRING || p->filter_string == NULL) {
+                return "string filter needs a JSONEX_STRING rule and filter_string";
+            }
+            break;
+        case JSONEX_FILTER_RANGE:
+            if (p->type != JSONEX_INTEGER) {
+                return "range filter needs a JSONEX_INTEGER rule";
+            }
+            break;
+        }
+
+        ruleset->depth[r] = depth;
+        if (p->type == JSONEX_STREAM) {
+            ruleset->streams_len++;
+        }
+        if (p->filter != JSONEX_FILTER_NONE) {
+            ruleset->filters_len++;
+        }
+        if (p->found == NULL) {
+            BIT_SET(ruleset->required, r);
+        }
+        ruleset->rules_len++;
+    }
+    return NULL;
+}
+
+void jsonex_init_ruleset(jsonex_context_t *context, const jsonex_ruleset_t *ruleset) {
+    context->ruleset = ruleset;
+    context->classify = jsonex_best_kernel();
+    context->decode_base64 = jsonex_best_base64_kernel();
+    context->bad_rules = 0;
+    memset(context->bindings, 0, sizeof(context->bindings));
+    context->record_fn = NULL;
+    context->record_user = NULL;
+    context->batch = NULL;
+    context->batch_full = 0;
+    context->options = 0;
+    context->index_fn = NULL;
+    context->index_user = NULL;
+    context->index_depth = 0;
+    context->project_write = NULL;
+    context->project_len = 0;
+    context->shape_len = 0;
+    context->shape_offsets[0] = 0;
+    context->shape_hits = 0;
+    context->shape_misses = 0;
+    context->string_escaped = 0;
+    context->emit_tokens = 0;
+    restart(context);
+}
+
+const char *jsonex_init(jsonex_context_t *context, jsonex_rule_t *rules) {
+    const char *error = jsonex_compile(&context->own_ruleset, rules);
+    if (error != NULL) {
+        // Rather than parse with the rules before the bad one.
+        context->own_ruleset.rules_len = 0;
+        context->own_ruleset.streams_len = 0;
+        context->own_ruleset.filters_len = 0;
+        memset(context->own_ruleset.required, 0, sizeof(context->own_ruleset.required));
+    }
+    jsonex_init_ruleset(context, &context->own_ruleset);
+    for (int r = 0; r < context->own_ruleset.rules_len; r++) {
+        jsonex_bind(context, r, rules[r].p, rules[r].found);
+    }
+    if (error != NULL) {
+        context->bad_rules = 1;
+        set_error(context, JSONEX_ERROR_BAD_RULES);
+    }
+    return error;
+}
+
+void jsonex_bind(jsonex_context_t *context, size_t r, void *p, int *found) {
+    context->bindings[r].p = p;
+    context->bindings[r].found = found;
+    if (found != NULL) {
+        *found = BIT_GET(context->found, r);
+    }
+}
+
+int jsonex_found(const jsonex_context_t *context, size_t r) {
+    return BIT_GET(context->found, r);
+}
+
+void jsonex_ndjson(jsonex_context_t *context, jsonex_record_fn_t fn, void *user) {
+    context->record_fn = fn;
+    context->record_user = user;
+}
+
+void jsonex_project(jsonex_context_t *context, char *buf, size_t size, jsonex_write_fn_t fn, void *user) {
+    context->project_write = fn;
+    context->project_user = user;
+    context->project_buf = buf;
+    context->project_size = size;
+    context->project_len = 0;
+    context->project_mark = 0;
+}
+
+void jsonex_index(jsonex_context_t *context, size_t depth, jsonex_index_fn_t fn, void *user) {
+    context->index_fn = fn;
+    context->index_user = user;
+    context->index_depth = depth;
+}
+
+void jsonex_start_member(jsonex_context_t *context, char *const *path, size_t depth, size_t offset) {
+    // The state object() leaves behind after a '{', inside a top-level
+    // value. Feeding '}' right away makes an empty object.
+    context->frames[0].status = IN_USE;
+    context->frames[0].fn = value_maybe_object;
+    context->frames[0].type = JSONEX_NONE;
+    context->frames[1].status = IN_USE;
+    context->frames[1].fn = object_maybe_empty;
+    context->frames[1].type = JSONEX_NONE;
+    for (int i = 2; i < JSONEX_CONTEXT_FRAME_COUNT; i++) {
+        context->frames[i].status = FREE;
+    }
+    context->frames_len = 2;
+
+    context->paths_len = 0;
+    for (size_t i = 0; i + 1 < depth; i++) {
+        strncpy(context->paths[i], path[i], JSONEX_MAX_STRING_SIZE - 1);
+        context->paths[i][JSONEX_MAX_STRING_SIZE - 1] = '\0';
+        context->paths_unicode[i] = 0;
+        context->paths_len++;
+    }
+
+    context->rejected = 0;
+    context->in_member = 1;
+    context->skip_depth = 0;
+    context->skip_in_string = 0;
+    context->skip_escape = 0;
+    context->resyncing = 0;
+    context->stream_rule = -1;
+    context->offset = offset;
+    clear_error(context);
+}
+
+static int batch_full(jsonex_batch_t *batch, const jsonex_ruleset_t *ruleset) {
+    if (batch->rows == batch->capacity) {
+        return 1;
+    }
+    // A string column must have room for the longest string we can parse.
+    for (int r = 0; r < ruleset->rules_len; r++) {
+        jsonex_column_t *column = &batch->columns[r];
+        if (ruleset->rules[r].type == JSONEX_STRING && column->offsets != NULL) {
+            size_t used = batch->rows == 0 ? 0 : column->offsets[batch->rows];
+            if (column->data_size - used < JSONEX_MAX_STRING_SIZE) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void batch_record(jsonex_context_t *context, const char *error, void *user) {
+    jsonex_batch_t *batch = user;
+    const jsonex_ruleset_t *ruleset = context->ruleset;
+
+    // Broken records are dropped, missing fields are only nulls.
+    if (context->error != JSONEX_OK && context->error != JSONEX_ERROR_MISSING_RULE) {
+        return;
+    }
+    if (batch->rows == batch->capacity) {
+        return;
+    }
+
+    size_t row = batch->rows;
+    for (int r = 0; r < ruleset->rules_len; r++) {
+        jsonex_column_t *column = &batch->columns[r];
+        int found = BIT_GET(context->found, r);
+        if (column->validity != NULL) {
+            if (found) {
+                BIT_SET(column->validity, row);
+            } else {
+                column->validity[row / 8] &= ~(1 << (row % 8));
+            }
+        }
+        if (found) {
+            continue;
+        }
+        // Store a zero or empty string for nulls, so that consumers can scan
+        // the values without looking at the validity first.
+        if (ruleset->rules[r].type == JSONEX_STRING && column->offsets != NULL) {
+            if (row == 0) {
+                column->offsets[0] = 0;
+            }
+            column->offsets[row + 1] = column->offsets[row];
+        } else if (ruleset->rules[r].type != JSONEX_STRING && column->values != NULL) {
+            column->values[row] = 0;
+        }
+    }
+    batch->rows++;
+
+    if (batch_full(batch, ruleset)) {
+        context->batch_full = 1;
+    }
+}
+
+void jsonex_batch(jsonex_context_t *context, jsonex_batch_t *batch) {
+    context->batch = batch;
+    context->batch_full = batch_full(batch, context->ruleset);
+    jsonex_ndjson(context, batch_record, batch);
+}
+
+void jsonex_options(jsonex_context_t *context, int options) {
+    context->options = options;
+}
+
+void jsonex_reset(jsonex_context_t *context) {
+    restart(context);
+}
+
+const char *jsonex_strerror(jsonex_error_t error) {
+    switch (error) {
+    case JSONEX_OK:
+        return "no error";
+    case JSONEX_ERROR_SYNTAX:
+        return "did not parse";
+    case JSONEX_ERROR_TRUNCATED:
+        return "input ended inside a value";
+    case JSONEX_ERROR_TOO_DEEP:
+        return "nested too deeply";
+    case JSONEX_ERROR_STRING_TOO_LONG:
+        return "string too long";
+    case JSONEX_ERROR_MISSING_RULE:
+        return "required rule did not match";
+    case JSONEX_ERROR_BAD_RULES:
+        return "bad rules";
+    case JSONEX_ERROR_BAD_BASE64:
+        return "bad base64 in string";
+    case JSONEX_ERROR_OUTPUT_FULL:
+        return "projection output buffer full";
+    case JSONEX_ERROR_INTERNAL:
+        return "internal error";
+    }
+    return "unknown error";
+}
+
+static int parse(jsonex_context_t *context, char c) {
+    if (context->skip_depth > 0) {
+        return skip(context, c);
+    }
+
     while (context->frames_len > 0) {
         // A parse_fn_t should return truthy if the character was consumed,
         // falsy otherwise.
@@ -644,6 +1637,21 @@ int jsonex_call(jsonex_context_t *context, char c) {
         // more context.)
     }
 
+    // A filter rule may have rejected the record halfway through this
+    // character.
+    if (context->skip_depth > 0) {
+        return skip(context, c);
+    }
+
+    // In NDJSON mode a complete record is handed over, and this character
+    // belongs to the next one.
+    if (context->record_fn != NULL && c != '\0' && !context->rejected &&
+            context->frames[0].is_complete) {
+        check_rules(context);
+        end_record(context);
+        return parse(context, c);
+    }
+
     // Eat up trailing whitespace.
     if (is_ws(c)) {
         return 1;
@@ -652,37 +1660,411 @@ int jsonex_call(jsonex_context_t *context, char c) {
     return 0;
 }
 
+static int can_resync(jsonex_context_t *context) {
+    return context->record_fn != NULL && (context->options & JSONEX_RESYNC);
+}
+
+static int between_records(jsonex_context_t *context) {
+    return context->frames_len == 1 && context->frames[0].fn == value && !context->rejected;
+}
+
+int jsonex_call(jsonex_context_t *context, char c) {
+    if (context->resyncing || (c == '\n' && can_resync(context) && context->skip_depth > 0)) {
+        // Skip to the end of the line, which also ends a rejected record.
+        if (c == '\n') {
+            reset(context);
+        }
+        advance(context, &c, 1);
+        return 1;
+    }
+
+    // Whitespace is only copied inside strings.
+    int in_string = context->frames_len > 0 &&
+        (context->frames[context->frames_len - 1].fn == string_contents ||
+         context->frames[context->frames_len - 1].fn == string_escape);
+    if (parse(context, c) && context->error == JSONEX_OK) {
+        if (context->project_copying && (in_string || !is_ws(c))) {
+            project_out(context, &c, 1);
+        }
+        if (c != '\n' || !can_resync(context) || between_records(context)) {
+            advance(context, &c, 1);
+            return 1;
+        }
+        // Records can't span lines when resyncing.
+        set_error(context, JSONEX_ERROR_TRUNCATED);
+    }
+
+    set_error(context, JSONEX_ERROR_SYNTAX);
+    if (!can_resync(context)) {
+        return 0;
+    }
+
+    // Report the broken record, and skip to the end of its line.
+    end_record(context);
+    context->resyncing = c != '\n';
+    advance(context, &c, 1);
+    return 1;
+}
+
+// Guesses that the key at s is the one that came next in the last record, and
+// if so takes it whole. Returns how many characters that was, or 0.
+static size_t predict_key(jsonex_context_t *context, const char *s, size_t n) {
+    size_t pos = context->shape_pos;
+    if (pos >= context->shape_len || context->shape_depth[pos] != context->paths_len) {
+        context->shape_misses++;
+        return 0;
+    }
+    const char *key = context->shape_keys + context->shape_offsets[pos];
+    size_t len = context->shape_offsets[pos + 1] - context->shape_offsets[pos];
+    if (len + 2 > n) {
+        return 0;
+    }
+    if (memcmp(s + 1, key, len) != 0 || s[len + 1] != '"') {
+        context->shape_misses++;
+        return 0;
+    }
+
+    // What object_key() and string() would have done.
+    if (context->frames[context->frames_len - 1].fn == object_maybe_empty) {
+        replace(context, object_key);
+    }
+    if (context->paths_len + 1 == context->index_depth) {
+        context->index_start = context->offset;
+    }
+    replace(context, object_colon);
+    call(context, string);
+    if (context->error != JSONEX_OK) {
+        return 0;
+    }
+    jsonex_frame_t *frame = &(context->frames[context->frames_len - 1]);
+    memcpy(frame->u.string, key, len);
+    frame->u.string[len] = '\0';
+    frame->type = JSONEX_STRING;
+    // Learned keys have no escapes.
+    context->string_unicode = 0;
+    close(context);
+
+    if (context->project_copying) {
+        project_out(context, s, len + 2);
+    }
+    context->shape_predicted = 1;
+    context->shape_hits++;
+    return len + 2;
+}
+
+static int eats_ws(parse_fn_t fn) {
+    return fn == value || fn == object_key || fn == object_maybe_empty ||
+        fn == object_colon || fn == object_value || fn == array_item;
+}
+
+size_t jsonex_feed(jsonex_context_t *context, const char *buf, size_t len) {
+    if (context->batch != NULL) {
+        context->batch_full = batch_full(context->batch, context->ruleset);
+        if (context->batch_full) {
+            return 0;
+        }
+    }
+
+    jsonex_classify_fn_t classify = context->classify;
+    jsonex_masks_t masks;
+    char tail[64];
+
+    size_t i = 0;
+    while (i < len) {
+        if (context->resyncing) {
+            const char *newline = memchr(buf + i, '\n', len - i);
+            size_t n = newline == NULL ? len - i : newline - (buf + i) + 1;
+            advance(context, buf + i, n);
+            i += n;
+            if (newline != NULL) {
+                reset(context);
+            }
+            continue;
+        }
+
+        // Classify the next 64 bytes, padding the end of the buffer with
+        // '\0', which stops all the fast paths below. When resyncing, every
+        // newline ends a record, and is left to jsonex_call().
+        size_t avail = len - i < 64 ? len - i : 64;
+        if (can_resync(context)) {
+            const char *newline = memchr(buf + i, '\n', avail);
+            if (newline != NULL) {
+                avail = newline - (buf + i);
+            }
+        }
+        const char *block = buf + i;
+        if (avail < 64) {
+            memset(tail, '\0', sizeof(tail));
+            memcpy(tail, buf + i, avail);
+            block = tail;
+        }
+
+        // Skipping a rejected record doesn't need the parse functions. The
+        // escape state at the end of a padded block would be wrong, so the
+        // end of the buffer goes byte by byte; before a newline it doesn't
+        // matter.
+        if (context->skip_depth > 0 && avail > 0 && (avail == 64 || avail < len - i)) {
+            classify(block, &masks);
+            size_t n = skip_block(context, block, &masks);
+            if (n > avail) {
+                n = avail;
+            }
+            advance(context, block, n);
+            i += n;
+            continue;
+        }
+
+        if (context->frames_len > 0 && context->skip_depth == 0) {
+            jsonex_frame_t *frame = &(context->frames[context->frames_len - 1]);
+            if (frame->fn == string_contents) {
+                // Copy everything up to the closing quote, an escape, or a
+                // character that needs looking at. If the string gets too
+                // long, let jsonex_call() find the exact spot.
+                classify(block, &masks);
+                size_t n = jsonex_first_bit(masks.quote | masks.backslash | masks.control);
+                if (n > string_room(frame) && !streaming(context, frame) &&
+                        string_kept(context, frame)) {
+                    n = string_room(frame);
+                }
+                if (n > 0) {
+                    if (context->project_copying) {
+                        project_out(context, block, n);
+                    }
+                    string_append(context, frame, block, n);
+                    advance(context, block, n);
+                    i += n;
+                    continue;
+                }
+            } else if (block[0] == '"' && (context->options & JSONEX_PREDICT_KEYS) &&
+                    (frame->fn == object_key || frame->fn == object_maybe_empty)) {
+                // A key has no raw newline, so it can't match across one.
+                size_t n = predict_key(context, buf + i, len - i);
+                if (n > 0) {
+                    advance(context, buf + i, n);
+                    i += n;
+                    continue;
+                }
+            } else if (is_ws(block[0]) && is_ws(block[1]) && eats_ws(frame->fn)) {
+                classify(block, &masks);
+                size_t n = jsonex_first_bit(~masks.whitespace);
+                advance(context, block, n);
+                i += n;
+                continue;
+            }
+        }
+
+        if (!jsonex_call(context, buf[i])) {
+            return i;
+        }
+        i++;
+
+        if (context->batch_full || context->tokens_len > 0) {
+            // Let the caller empty the batch, or take the tokens, before
+            // going on.
+            return i;
+        }
+    }
+    return len;
+}
+
 const char *jsonex_finish(jsonex_context_t *context) {
+    // The record that was being skipped has already been reported.
+    if (context->resyncing) {
+        return NULL;
+    }
+    if (context->error != JSONEX_OK) {
+        return jsonex_strerror(context->error);
+    }
+
+    // A record rejected by a filter is fine, as long as it was skipped to its
+    // end.
+    if (context->rejected) {
+        if (context->skip_depth > 0) {
+            set_error(context, JSONEX_ERROR_TRUNCATED);
+            return jsonex_strerror(context->error);
+        }
+        if (context->in_member) {
+            context->in_member = 0;
+            skip_end(context);
+        }
+        return NULL;
+    }
+
+    // In NDJSON mode, the input may end right between two records.
+    if (context->record_fn != NULL && between_records(context)) {
+        return NULL;
+    }
+
     // All parse functions should complete() or abort() when given '\0', so
     // each time we call_context(.., '\0') there should be one less frame.
     while (context->frames_len > 0) {
         size_t old_context_len = context->frames_len;
-        if (jsonex_call(context, '\0')) {
-            return "internal error: some parse function consumed '\\0'";
+        if (parse(context, '\0') || context->frames_len >= old_context_len) {
+            set_error(context, JSONEX_ERROR_INTERNAL);
+            return jsonex_strerror(context->error);
         }
-        if (context->frames_len >= old_context_len) {
-            return "internal error: context->frames_len not decreasing";
+    }
+
+    // Since init_context() put something on the context, and there was nothing
+    // left to reap() it, we ought to have a zombie left over telling us
+    // whether the parse succeeded or failed.
+    if (context->frames[0].status != ZOMBIE) {
+        set_error(context, JSONEX_ERROR_INTERNAL);
+    } else if (context->frames[0].is_complete) {
+        check_rules(context);
+    } else {
+        set_error(context, JSONEX_ERROR_TRUNCATED);
+    }
+
+    if (context->record_fn == NULL) {
+        index_record(context);
+        if (context->project_write != NULL && context->error == JSONEX_OK) {
+            project_flush(context);
         }
     }
+    if (context->record_fn != NULL &&
+            (context->error == JSONEX_OK || context->error == JSONEX_ERROR_MISSING_RULE ||
+             can_resync(context))) {
+        // Hand over the last record, which had no trailing newline.
+        end_record(context);
+        return NULL;
+    }
+    if (context->error != JSONEX_OK) {
+        return jsonex_strerror(context->error);
+    }
+    return NULL;
+}
 
-    // Check all rules - if there was any required one that was no found, then
-    // that's an error.
-    const char *rule_fail = NULL;
-    for (jsonex_rule_t *p = context->rules; p->type != JSONEX_NONE; p++) {
-        if (p->found == &missing) {
-            rule_fail = "required rule did not match";
+const char *jsonex_end_member(jsonex_context_t *context) {
+    // Close the object jsonex_start_member() opened. If that '}' didn't end
+    // up closing it, the member was cut short.
+    if (!jsonex_call(context, '}') || context->error != JSONEX_OK) {
+        return jsonex_strerror(context->error);
+    }
+    // A rejected member was skipped, and with it the frames.
+    if (context->rejected ? context->skip_depth > 0 : context->frames_len != 1) {
+        set_error(context, JSONEX_ERROR_TRUNCATED);
+        return jsonex_strerror(context->error);
+    }
+    return NULL;
+}
+
+void jsonex_cursor_init(jsonex_cursor_t *cursor, const char *buf, size_t len) {
+    static const jsonex_rule_t no_rules[] = { { .type = JSONEX_NONE } };
+    jsonex_compile(&cursor->context.own_ruleset, no_rules);
+    jsonex_init_ruleset(&cursor->context, &cursor->context.own_ruleset);
+    cursor->context.emit_tokens = 1;
+    cursor->buf = buf;
+    cursor->len = len;
+    cursor->pos = 0;
+    cursor->finished = 0;
+    cursor->token = JSONEX_TOKEN_NONE;
+}
+
+jsonex_token_t jsonex_next_token(jsonex_cursor_t *cursor) {
+    jsonex_context_t *context = &cursor->context;
+
+    // jsonex_feed() stops right after the character that made a token.
+    while (context->tokens_len == 0 && context->error == JSONEX_OK) {
+        if (cursor->pos < cursor->len) {
+            cursor->pos += jsonex_feed(context, cursor->buf + cursor->pos, cursor->len - cursor->pos);
+        } else if (!cursor->finished) {
+            // A number at the very end only ends here.
+            cursor->finished = 1;
+            jsonex_finish(context);
+        } else {
             break;
         }
     }
 
-    // Since init_context() put something on the context, and there was nothing
-    // left to reap() it, we ought to have a zombie left over telling us
-    // whether the parse succeeded or failed.
-    if (context->frames[0].status != ZOMBIE) {
-        return "internal error: first frame isn't a zombie";
+    if (context->tokens_len == 0) {
+        cursor->token = JSONEX_TOKEN_NONE;
+    } else {
+        cursor->token = context->tokens[0];
+        context->tokens_len--;
+        memmove(context->tokens, context->tokens + 1, context->tokens_len * sizeof(context->tokens[0]));
+    }
+    return cursor->token;
+}
+
+int jsonex_enter(jsonex_cursor_t *cursor) {
+    jsonex_token_t token = jsonex_next_token(cursor);
+    return token == JSONEX_TOKEN_BEGIN_OBJECT || token == JSONEX_TOKEN_BEGIN_ARRAY;
+}
+
+int jsonex_skip_value(jsonex_cursor_t *cursor) {
+    jsonex_context_t *context = &cursor->context;
+    jsonex_token_t token = cursor->token;
+    if (token != JSONEX_TOKEN_BEGIN_OBJECT && token != JSONEX_TOKEN_BEGIN_ARRAY) {
+        token = jsonex_next_token(cursor);
+    }
+
+    switch (token) {
+    case JSONEX_TOKEN_STRING:
+    case JSONEX_TOKEN_NUMBER:
+    case JSONEX_TOKEN_TRUE:
+    case JSONEX_TOKEN_FALSE:
+    case JSONEX_TOKEN_NULL:
+        return 1;
+    case JSONEX_TOKEN_BEGIN_OBJECT:
+    case JSONEX_TOKEN_BEGIN_ARRAY:
+        break;
+    default:
+        return 0;
+    }
+
+    // The same bracket counting that skips a rejected record, from just
+    // inside the opening bracket.
+    context->skip_depth = 1;
+    context->skip_in_string = 0;
+    context->skip_escape = 0;
+    context->skipping_value = 1;
+    while (context->skip_depth > 0 && context->error == JSONEX_OK) {
+        if (cursor->pos == cursor->len) {
+            set_error(context, JSONEX_ERROR_TRUNCATED);
+            break;
+        }
+        cursor->pos += jsonex_feed(context, cursor->buf + cursor->pos, cursor->len - cursor->pos);
     }
-    if (context->frames[0].is_complete) {
-        return rule_fail;
+    cursor->token = token == JSONEX_TOKEN_BEGIN_OBJECT ? JSONEX_TOKEN_END_OBJECT : JSONEX_TOKEN_END_ARRAY;
+    return context->error == JSONEX_OK;
+}
+
+int jsonex_key_equals(const jsonex_cursor_t *cursor, const char *key) {
+    return cursor->token == JSONEX_TOKEN_KEY && strcmp(cursor->context.token_frame.u.string, key) == 0;
+}
+
+const char *jsonex_get_string(const jsonex_cursor_t *cursor) {
+    if (cursor->token != JSONEX_TOKEN_KEY && cursor->token != JSONEX_TOKEN_STRING) {
+        return NULL;
+    }
+    return cursor->context.token_frame.u.string;
+}
+
+int jsonex_get_int(const jsonex_cursor_t *cursor, int *value) {
+    if (cursor->token != JSONEX_TOKEN_NUMBER) {
+        return 0;
+    }
+    *value = number_value(&cursor->context.token_frame);
+    return 1;
+}
+
+int jsonex_get_double(const jsonex_cursor_t *cursor, double *value) {
+    if (cursor->token != JSONEX_TOKEN_NUMBER) {
+        return 0;
+    }
+    const jsonex_frame_t *frame = &cursor->context.token_frame;
+    *value = frame->u.number.integer_part + frame->u.number.decimal_part;
+    if (frame->u.number.negative) {
+        *value = -*value;
+    }
+    return 1;
+}
+
+int jsonex_get_bool(const jsonex_cursor_t *cursor, int *value) {
+    if (cursor->token != JSONEX_TOKEN_TRUE && cursor->token != JSONEX_TOKEN_FALSE) {
+        return 0;
     }
-    return "did not parse";
+    *value = cursor->token == JSONEX_TOKEN_TRUE;
+    return 1;
 }
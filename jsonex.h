@@ -2,27 +2,159 @@
 #define __JSONEX_H__
 
 #include <stddef.h>
+#include <stdint.h>
+
+#include "jsonex_simd.h"
 
 #define JSONEX_MAX_STRING_SIZE 64
 #define JSONEX_CONTEXT_FRAME_COUNT 16
+#define JSONEX_MAX_RULES 32
+#define JSONEX_STREAM_CHUNK_SIZE 256
+// How many keys, and how many bytes of them, JSONEX_PREDICT_KEYS remembers.
+#define JSONEX_SHAPE_KEYS 32
+#define JSONEX_SHAPE_SIZE 512
 
 typedef enum {
     JSONEX_INTEGER,
     JSONEX_STRING,
     JSONEX_BOOL,
+    // A string of any length, handed to a jsonex_stream_t as it is parsed.
+    JSONEX_STREAM,
     JSONEX_NONE
 } jsonex_type_t;
 
+typedef enum {
+    JSONEX_OK,
+    JSONEX_ERROR_SYNTAX,
+    // The input ended in the middle of a value.
+    JSONEX_ERROR_TRUNCATED,
+    // Nested deeper than JSONEX_CONTEXT_FRAME_COUNT allows.
+    JSONEX_ERROR_TOO_DEEP,
+    JSONEX_ERROR_STRING_TOO_LONG,
+    JSONEX_ERROR_MISSING_RULE,
+    // jsonex_init() got rules that jsonex_compile() rejects.
+    JSONEX_ERROR_BAD_RULES,
+    // A JSONEX_STREAM rule with base64 set got something else.
+    JSONEX_ERROR_BAD_BASE64,
+    // A projected record that can't be written out yet filled the buffer
+    // given to jsonex_project().
+    JSONEX_ERROR_OUTPUT_FULL,
+    JSONEX_ERROR_INTERNAL
+} jsonex_error_t;
+
+// Options for jsonex_options().
+// Keep the line and column of errors, not just their offset.
+#define JSONEX_TRACK_LINES 1
+// In NDJSON mode, report a broken record and carry on after its line.
+#define JSONEX_RESYNC 2
+// Expect the keys of each record to come in the same order as in the last one,
+// and check the expected key in one go before parsing it the usual way.
+#define JSONEX_PREDICT_KEYS 4
+
+typedef enum {
+    JSONEX_FILTER_NONE,
+    // The string value must equal filter_string.
+    JSONEX_FILTER_EQUALS,
+    // The string value must start with filter_string.
+    JSONEX_FILTER_PREFIX,
+    // The integer value must be within [filter_min, filter_max].
+    JSONEX_FILTER_RANGE
+} jsonex_filter_t;
+
 typedef struct {
     jsonex_type_t type;
     void *p;
     char **path;
     int *found;
+    jsonex_filter_t filter;
+    const char *filter_string;
+    int filter_min;
+    int filter_max;
 } jsonex_rule_t;
 
+// Rules checked and counted by jsonex_compile(). Nothing writes to a ruleset
+// after that, so one can be shared by any number of contexts and threads.
+typedef struct {
+    const jsonex_rule_t *rules;
+    size_t rules_len;
+    unsigned char depth[JSONEX_MAX_RULES];
+    unsigned char required[(JSONEX_MAX_RULES + 7) / 8];
+    size_t streams_len;
+    size_t filters_len;
+} jsonex_ruleset_t;
+
+// Where a context stores what a rule matched, the same as a rule's .p and
+// .found.
+typedef struct {
+    void *p;
+    int *found;
+} jsonex_binding_t;
+
+// Where batch mode stores one rule's values, one row per record. Missing
+// values are stored as 0 or "", and their bit in validity is cleared.
+typedef struct {
+    // JSONEX_INTEGER and JSONEX_BOOL: capacity values.
+    int *values;
+    // JSONEX_STRING: row i is data[offsets[i]] up to data[offsets[i + 1]],
+    // not '\0'-terminated. offsets has capacity + 1 entries.
+    uint32_t *offsets;
+    char *data;
+    size_t data_size;
+    // One bit per row, least significant bit first; may be NULL.
+    unsigned char *validity;
+} jsonex_column_t;
+
+typedef struct {
+    // One column per rule.
+    jsonex_column_t *columns;
+    size_t capacity;
+    // Rows filled so far. Set back to 0 once they have been used.
+    size_t rows;
+} jsonex_batch_t;
+
+// What jsonex_next_token() returns.
+typedef enum {
+    // The end of the input, or an error.
+    JSONEX_TOKEN_NONE,
+    JSONEX_TOKEN_BEGIN_OBJECT,
+    JSONEX_TOKEN_END_OBJECT,
+    JSONEX_TOKEN_BEGIN_ARRAY,
+    JSONEX_TOKEN_END_ARRAY,
+    JSONEX_TOKEN_KEY,
+    JSONEX_TOKEN_STRING,
+    JSONEX_TOKEN_NUMBER,
+    JSONEX_TOKEN_TRUE,
+    JSONEX_TOKEN_FALSE,
+    JSONEX_TOKEN_NULL
+} jsonex_token_t;
+
+#define JSONEX_TOKEN_QUEUE_SIZE 4
+
 struct jsonex_context;
 struct jsonex_frame;
 
+// Called once per complete record in NDJSON mode. The error is NULL if the
+// record parsed and all required rules matched.
+typedef void (*jsonex_record_fn_t)(struct jsonex_context *, const char *, void *);
+
+// Called by jsonex_index() with the offset and length of every object member
+// at the indexed depth, from its key up to the end of its value, while
+// context->paths still holds its path. At depth 0 it is called for every
+// record instead.
+typedef void (*jsonex_index_fn_t)(struct jsonex_context *, size_t, size_t, void *);
+
+// Called with each chunk of a streamed string, at most
+// JSONEX_STREAM_CHUNK_SIZE bytes, and once more with no bytes at its end.
+typedef void (*jsonex_write_fn_t)(struct jsonex_context *, const char *, size_t, void *);
+
+// What a JSONEX_STREAM rule's .p points to.
+typedef struct {
+    jsonex_write_fn_t write;
+    void *user;
+    // Decode the string from base64 before writing it.
+    int base64;
+} jsonex_stream_t;
+
 typedef int (*parse_fn_t)(struct jsonex_context *, struct jsonex_frame *, char);
 
 typedef struct jsonex_frame {
@@ -55,13 +187,174 @@ typedef struct jsonex_context {
     jsonex_frame_t frames[JSONEX_CONTEXT_FRAME_COUNT];
     size_t frames_len;
     char paths[JSONEX_CONTEXT_FRAME_COUNT][JSONEX_MAX_STRING_SIZE];
+    // Bit i of paths_unicode[k] is set if the backslash at paths[k][i] starts
+    // a \uXXXX escape that was kept as it is, rather than being a backslash
+    // itself; string_unicode is the same for the string being parsed.
+    uint64_t paths_unicode[JSONEX_CONTEXT_FRAME_COUNT];
+    uint64_t string_unicode;
     size_t paths_len;
-    jsonex_rule_t *rules;
-    const char *error;
+    const jsonex_ruleset_t *ruleset;
+    jsonex_binding_t bindings[JSONEX_MAX_RULES];
+    unsigned char found[(JSONEX_MAX_RULES + 7) / 8];
+    // What jsonex_init() compiles its rules into. If that failed, every
+    // record fails with JSONEX_ERROR_BAD_RULES.
+    jsonex_ruleset_t own_ruleset;
+    int bad_rules;
+    jsonex_error_t error;
+    // Where the error happened. Line and column start at 1, and are only
+    // kept with JSONEX_TRACK_LINES.
+    size_t error_offset;
+    size_t error_line;
+    size_t error_column;
+    // Offset of the next character, and of the start of its line.
+    size_t offset;
+    size_t line;
+    size_t line_offset;
+    int options;
+    int resyncing;
+    // Set when a filter rule rejected the current record; the rest of it is
+    // skipped by counting brackets, without running the parse functions.
+    int rejected;
+    // Set by jsonex_start_member(), so that a record rejected in one member
+    // only ends once jsonex_finish() is called.
+    int in_member;
+    size_t skip_depth;
+    int skip_in_string;
+    int skip_escape;
+    // The kernel jsonex_feed() classifies blocks with. It is picked once per
+    // context, so that contexts on different threads share nothing.
+    jsonex_classify_fn_t classify;
+    // Likewise, the kernel JSONEX_STREAM rules decode base64 with.
+    jsonex_base64_fn_t decode_base64;
+    jsonex_record_fn_t record_fn;
+    void *record_user;
+    jsonex_batch_t *batch;
+    int batch_full;
+    jsonex_index_fn_t index_fn;
+    void *index_user;
+    size_t index_depth;
+    size_t index_start;
+    // Records completed since the last jsonex_reset().
+    size_t records;
+    // The JSONEX_STREAM rule whose string is in frames[stream_frame], or -1.
+    int stream_rule;
+    size_t stream_frame;
+    // Base64 sextets that don't make up a byte yet.
+    uint32_t stream_bits;
+    int stream_sextets;
+    char stream_buf[JSONEX_STREAM_CHUNK_SIZE];
+    size_t stream_len;
+    // Projection output, see jsonex_project(). project_mark is where the
+    // current record starts in project_buf.
+    jsonex_write_fn_t project_write;
+    void *project_user;
+    char *project_buf;
+    size_t project_size;
+    size_t project_len;
+    size_t project_mark;
+    // Set while a matched value is copied through; it is the value of the
+    // member whose object is in frames[project_copy_frame - 1].
+    int project_copying;
+    size_t project_copy_frame;
+    // Whether the object or array in each frame is being written out, and
+    // whether it needs a comma before its next member.
+    unsigned char project_state[JSONEX_CONTEXT_FRAME_COUNT];
+    // The keys of the last record in order, for JSONEX_PREDICT_KEYS. Key i is
+    // shape_keys[shape_offsets[i]] up to shape_keys[shape_offsets[i + 1]],
+    // found at depth shape_depth[i]; shape_rule[i] is a rule with its path,
+    // or -1.
+    char shape_keys[JSONEX_SHAPE_SIZE];
+    uint16_t shape_offsets[JSONEX_SHAPE_KEYS + 1];
+    unsigned char shape_depth[JSONEX_SHAPE_KEYS];
+    signed char shape_rule[JSONEX_SHAPE_KEYS];
+    size_t shape_len;
+    // The next key in this record, and the key of each path component.
+    size_t shape_pos;
+    int shape_member[JSONEX_CONTEXT_FRAME_COUNT];
+    int shape_predicted;
+    // Whether the last string had an escape in it. Predictions are compared
+    // with the raw input, so such a key is never learned.
+    int string_escaped;
+    // Keys cut off by the end of the buffer count as neither.
+    size_t shape_hits;
+    size_t shape_misses;
+    // Tokens seen by the parse functions for a jsonex_cursor_t, and the
+    // value of the last key or scalar among them.
+    int emit_tokens;
+    jsonex_token_t tokens[JSONEX_TOKEN_QUEUE_SIZE];
+    size_t tokens_len;
+    jsonex_frame_t token_frame;
+    // Set when skipping brackets stops at the end of a value rather than of
+    // a rejected record.
+    int skipping_value;
 } jsonex_context_t;
 
-void jsonex_init(jsonex_context_t *, jsonex_rule_t *);
+// Pulls tokens out of a buffer holding a whole document, for when what to
+// read next depends on what has been read so far.
+typedef struct {
+    jsonex_context_t context;
+    const char *buf;
+    size_t len;
+    size_t pos;
+    int finished;
+    jsonex_token_t token;
+} jsonex_cursor_t;
+
+// Returns NULL, or why the rules are invalid, in which case every input fails
+// with JSONEX_ERROR_BAD_RULES.
+const char *jsonex_init(jsonex_context_t *, jsonex_rule_t *);
+const char *jsonex_compile(jsonex_ruleset_t *, const jsonex_rule_t *);
+// Like jsonex_init(), but nothing is stored until rules are bound to outputs
+// with jsonex_bind().
+void jsonex_init_ruleset(jsonex_context_t *, const jsonex_ruleset_t *);
+void jsonex_bind(jsonex_context_t *, size_t, void *, int *);
+int jsonex_found(const jsonex_context_t *, size_t);
+void jsonex_ndjson(jsonex_context_t *, jsonex_record_fn_t, void *);
+// Stores the records of an NDJSON stream into columns instead. jsonex_feed()
+// returns early, with no error, once the batch is full.
+void jsonex_batch(jsonex_context_t *, jsonex_batch_t *);
+void jsonex_options(jsonex_context_t *, int);
+void jsonex_index(jsonex_context_t *, size_t, jsonex_index_fn_t, void *);
+// Writes a minified copy of the input that only keeps the rules' paths. Output
+// collects in the buffer, and goes to the callback at the end of every record
+// (or the document), or whenever the buffer fills up. With filter rules or
+// JSONEX_RESYNC, a record must fit in the buffer until it is accepted.
+void jsonex_project(jsonex_context_t *, char *, size_t, jsonex_write_fn_t, void *);
+// Starts parsing in the middle of an input, at a member of the object whose
+// path is the given depth - 1 components, as found by jsonex_index(). The
+// offset is that of the member in the input, for error positions. Found rules
+// are kept, so that several members can add up to one record.
+void jsonex_start_member(jsonex_context_t *, char *const *, size_t, size_t);
+// Checks that the member fed since jsonex_start_member() has ended. If a filter
+// rejected the record, context->rejected is set, and the record's other
+// members shouldn't be fed.
+const char *jsonex_end_member(jsonex_context_t *);
+const char *jsonex_strerror(jsonex_error_t);
+// Starts over on a new input, keeping the rules, NDJSON callback and options.
+void jsonex_reset(jsonex_context_t *);
 int jsonex_call(jsonex_context_t *, char);
+// Returns how many characters were consumed. That is less than len if the
+// input did not parse, with context->error set, but also, with no error, once
+// a batch is full or the cursor has a token to take; the rest is fed again
+// after that.
+size_t jsonex_feed(jsonex_context_t *, const char *, size_t);
 const char *jsonex_finish(jsonex_context_t *);
 
+void jsonex_cursor_init(jsonex_cursor_t *, const char *, size_t);
+jsonex_token_t jsonex_next_token(jsonex_cursor_t *);
+// Moves into the object or array that comes next. Returns 0 if the next token
+// is anything else.
+int jsonex_enter(jsonex_cursor_t *);
+// Skips the object or array the cursor just entered, or else the next value,
+// counting brackets without parsing what's in between. Returns 0 if there was
+// no value or it didn't parse.
+int jsonex_skip_value(jsonex_cursor_t *);
+// These look at the current token.
+int jsonex_key_equals(const jsonex_cursor_t *, const char *);
+// The string of a JSONEX_TOKEN_KEY or JSONEX_TOKEN_STRING, or NULL.
+const char *jsonex_get_string(const jsonex_cursor_t *);
+int jsonex_get_int(const jsonex_cursor_t *, int *);
+int jsonex_get_double(const jsonex_cursor_t *, double *);
+int jsonex_get_bool(const jsonex_cursor_t *, int *);
+
 #endif
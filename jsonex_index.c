@@ -0,0 +1,213 @@
+#include <string.h>
+
+#include "jsonex_index.h"
+
+struct builder {
+    FILE *sidecar;
+    const char *error;
+};
+
+uint64_t jsonex_index_hash(char *const *path, size_t depth) {
+    // The '\0' after each component keeps ["ab", "c"] apart from ["a", "bc"].
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < depth; i++) {
+        const char *p = path[i];
+        do {
+            hash ^= (unsigned char)*p;
+            hash *= 1099511628211ULL;
+        } while (*p++ != '\0');
+    }
+    return hash;
+}
+
+static void on_entry(jsonex_context_t *context, size_t offset, size_t length, void *user) {
+    struct builder *builder = user;
+    char *path[JSONEX_CONTEXT_FRAME_COUNT];
+    for (size_t i = 0; i < context->paths_len; i++) {
+        path[i] = context->paths[i];
+    }
+
+    jsonex_index_entry_t entry;
+    entry.path_hash = jsonex_index_hash(path, context->paths_len);
+    entry.offset = offset;
+    entry.length = length;
+    entry.record = context->records;
+    if (entry.length != length || entry.record != context->records) {
+        builder->error = "too large to index";
+    } else if (fwrite(&entry, sizeof(entry), 1, builder->sidecar) != 1) {
+        builder->error = "write failed";
+    }
+}
+
+static void on_record(jsonex_context_t *context, const char *error, void *user) {
+}
+
+const char *jsonex_index_build(FILE *json, FILE *sidecar, size_t depth, int ndjson) {
+    static const jsonex_rule_t no_rules[] = { { .type = JSONEX_NONE } };
+    if (depth >= JSONEX_CONTEXT_FRAME_COUNT) {
+        return "index too deep";
+    }
+
+    jsonex_ruleset_t ruleset;
+    jsonex_context_t context;
+    struct builder builder = { .sidecar = sidecar, .error = NULL };
+    jsonex_compile(&ruleset, no_rules);
+    jsonex_init_ruleset(&context, &ruleset);
+    if (ndjson) {
+        jsonex_ndjson(&context, on_record, NULL);
+    }
+    jsonex_index(&context, depth, on_entry, &builder);
+
+    jsonex_index_header_t header;
+    memcpy(header.magic, JSONEX_INDEX_MAGIC, sizeof(header.magic));
+    header.depth = depth;
+    header.ndjson = ndjson != 0;
+    if (fwrite(&header, sizeof(header), 1, sidecar) != 1) {
+        return "write failed";
+    }
+
+    char buf[JSONEX_INDEX_READ_SIZE];
+    size_t n;
+    rewind(json);
+    while ((n = fread(buf, 1, sizeof(buf), json)) > 0) {
+        // This context has no batch or cursor, so stopping early is an error.
+        if (jsonex_feed(&context, buf, n) < n) {
+            return jsonex_strerror(context.error);
+        }
+        if (builder.error != NULL) {
+            return builder.error;
+        }
+    }
+    if (ferror(json)) {
+        return "read failed";
+    }
+
+    const char *error = jsonex_finish(&context);
+    if (error == NULL) {
+        error = builder.error;
+    }
+    return error;
+}
+
+static const char *feed_range(FILE *json, jsonex_context_t *context, uint64_t offset, uint64_t length) {
+    char buf[JSONEX_INDEX_READ_SIZE];
+    if (fseek(json, offset, SEEK_SET) != 0) {
+        return "seek failed";
+    }
+    while (length > 0) {
+        size_t n = length < sizeof(buf) ? length : sizeof(buf);
+        if (fread(buf, 1, n, json) != n) {
+            return "read failed";
+        }
+        // jsonex_index_extract() refused contexts that stop with no error.
+        if (jsonex_feed(context, buf, n) < n) {
+            return jsonex_strerror(context->error);
+        }
+        length -= n;
+    }
+    return NULL;
+}
+
+// Returns a rule whose path goes through the entry, or -1.
+static int entry_rule(const jsonex_ruleset_t *ruleset, const uint64_t *hashes, const jsonex_index_entry_t *entry) {
+    for (int r = 0; r < ruleset->rules_len; r++) {
+        if (hashes[r] == entry->path_hash) {
+            return r;
+        }
+    }
+    return -1;
+}
+
+const char *jsonex_index_extract(FILE *json, FILE *sidecar, jsonex_context_t *context) {
+    jsonex_index_header_t header;
+    rewind(sidecar);
+    if (fread(&header, sizeof(header), 1, sidecar) != 1 ||
+            memcmp(header.magic, JSONEX_INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+            header.depth >= JSONEX_CONTEXT_FRAME_COUNT) {
+        return "not an index";
+    }
+    // Both would stop feeding early, with no error and no one to empty them.
+    if (context->batch != NULL || context->emit_tokens) {
+        return "batch and cursor contexts can't be extracted into";
+    }
+    int ndjson = context->record_fn != NULL;
+    if (header.ndjson != ndjson) {
+        return "index is for another kind of input";
+    }
+
+    // Members are found by the hash of their path, so only the first depth
+    // components of each rule's path count. The parser only compares the
+    // member's own key, and takes the components above it from the rule, so
+    // a collision between two paths that end in the same key would extract
+    // the wrong member; with 64 bits, that is left to chance.
+    const jsonex_ruleset_t *ruleset = context->ruleset;
+    uint64_t hashes[JSONEX_MAX_RULES];
+    for (int r = 0; r < ruleset->rules_len; r++) {
+        if (ruleset->depth[r] < header.depth) {
+            return "rule is shallower than the index";
+        }
+        hashes[r] = jsonex_index_hash(ruleset->rules[r].path, header.depth);
+    }
+
+    jsonex_reset(context);
+    jsonex_index_entry_t entry;
+    int started = 0;
+    int rejected = 0;
+    uint32_t record = 0;
+    const char *error;
+    while (fread(&entry, sizeof(entry), 1, sidecar) == 1) {
+        if (header.depth == 0) {
+            if ((error = feed_range(json, context, entry.offset, entry.length)) != NULL) {
+                return error;
+            }
+            // The newline hands over the record.
+            if (ndjson && !jsonex_call(context, '\n')) {
+                return jsonex_strerror(context->error);
+            }
+            continue;
+        }
+
+        int r = entry_rule(ruleset, hashes, &entry);
+        if (r < 0) {
+            continue;
+        }
+        if (ndjson && started && entry.record != record) {
+            if ((error = jsonex_finish(context)) != NULL) {
+                return error;
+            }
+            rejected = 0;
+        }
+        // The rest of a record a filter rejected is left alone.
+        if (rejected) {
+            continue;
+        }
+        jsonex_start_member(context, ruleset->rules[r].path, header.depth, entry.offset);
+        started = 1;
+        record = entry.record;
+        if ((error = feed_range(json, context, entry.offset, entry.length)) != NULL ||
+                (error = jsonex_end_member(context)) != NULL) {
+            return error;
+        }
+        rejected = context->rejected;
+        if (rejected && !ndjson) {
+            break;
+        }
+    }
+    if (ferror(sidecar)) {
+        return "read failed";
+    }
+
+    // A document none of whose members were needed still has its required
+    // rules checked, as if it were empty.
+    if (header.depth > 0 && !started && !ndjson) {
+        char *empty[JSONEX_CONTEXT_FRAME_COUNT];
+        for (size_t i = 0; i < header.depth; i++) {
+            empty[i] = "";
+        }
+        jsonex_start_member(context, empty, header.depth, 0);
+        if ((error = jsonex_end_member(context)) != NULL) {
+            return error;
+        }
+    }
+    return jsonex_finish(context);
+}
@@ -0,0 +1,41 @@
+#ifndef __JSONEX_INDEX_H__
+#define __JSONEX_INDEX_H__
+
+#include <stdio.h>
+
+#include "jsonex.h"
+
+#define JSONEX_INDEX_MAGIC "jsonexi1"
+#define JSONEX_INDEX_READ_SIZE 4096
+
+// A sidecar index is this header, followed by one entry per object member at
+// the indexed depth (or per record, at depth 0), in input order. Numbers are
+// stored in the byte order of the machine that built it.
+typedef struct {
+    char magic[8];
+    uint32_t depth;
+    // 1 if the input is NDJSON.
+    uint32_t ndjson;
+} jsonex_index_header_t;
+
+typedef struct {
+    // FNV-1a of the member's path, see jsonex_index_hash().
+    uint64_t path_hash;
+    uint64_t offset;
+    uint32_t length;
+    // The NDJSON record the member belongs to, counting from 0.
+    uint32_t record;
+} jsonex_index_entry_t;
+
+uint64_t jsonex_index_hash(char *const *, size_t);
+// Parses all of json once, and writes the offsets of everything at the given
+// depth to the sidecar.
+const char *jsonex_index_build(FILE *json, FILE *sidecar, size_t depth, int ndjson);
+// Extracts the context's rules from json, parsing only the members the sidecar
+// says lie on their paths. The context should be set up as for parsing all of
+// json, with jsonex_ndjson() for NDJSON, but not with jsonex_batch() or as a
+// cursor's; records none of whose members are on a rule's path are not
+// reported.
+const char *jsonex_index_extract(FILE *json, FILE *sidecar, jsonex_context_t *context);
+
+#endif
@@ -0,0 +1,107 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "jsonex_pool.h"
+
+static void on_record(jsonex_context_t *context, const char *error, void *user) {
+    jsonex_pool_slot_t *slot = user;
+    if (slot->pool->record_fn != NULL) {
+        slot->pool->record_fn(slot, error);
+    }
+}
+
+static void release(jsonex_pool_t *pool, jsonex_pool_slot_t *slot, const char *error) {
+    epoll_ctl(pool->epoll_fd, EPOLL_CTL_DEL, slot->fd, NULL);
+    if (pool->close_fn != NULL) {
+        pool->close_fn(slot, error);
+    }
+    close(slot->fd);
+    slot->fd = -1;
+    slot->next_free = pool->free;
+    pool->free = slot;
+}
+
+const char *jsonex_pool_init(jsonex_pool_t *pool, jsonex_pool_slot_t *slots, size_t slots_len, jsonex_pool_fn_t record_fn, jsonex_pool_fn_t close_fn) {
+    pool->epoll_fd = epoll_create1(0);
+    if (pool->epoll_fd < 0) {
+        return "epoll_create1 failed";
+    }
+    pool->slots = slots;
+    pool->slots_len = slots_len;
+    pool->record_fn = record_fn;
+    pool->close_fn = close_fn;
+
+    // Hand out the lowest slots first, so that a lightly loaded pool stays in
+    // as few cache lines as possible.
+    pool->free = NULL;
+    for (size_t i = slots_len; i > 0; i--) {
+        jsonex_pool_slot_t *slot = &slots[i - 1];
+        slot->fd = -1;
+        slot->pool = pool;
+        slot->next_free = pool->free;
+        pool->free = slot;
+    }
+    return NULL;
+}
+
+jsonex_pool_slot_t *jsonex_pool_add(jsonex_pool_t *pool, int fd, void *user) {
+    jsonex_pool_slot_t *slot = pool->free;
+    if (slot == NULL || slot->context.batch != NULL || slot->context.emit_tokens) {
+        return NULL;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = slot;
+    if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        return NULL;
+    }
+
+    pool->free = slot->next_free;
+    slot->next_free = NULL;
+    slot->fd = fd;
+    slot->user = user;
+    jsonex_reset(&slot->context);
+    jsonex_ndjson(&slot->context, on_record, slot);
+    return slot;
+}
+
+const char *jsonex_pool_run(jsonex_pool_t *pool, int timeout) {
+    struct epoll_event events[JSONEX_POOL_EVENT_COUNT];
+    int n = epoll_wait(pool->epoll_fd, events, JSONEX_POOL_EVENT_COUNT, timeout);
+    if (n < 0) {
+        return errno == EINTR ? NULL : "epoll_wait failed";
+    }
+
+    for (int i = 0; i < n; i++) {
+        jsonex_pool_slot_t *slot = events[i].data.ptr;
+
+        // One read per ready connection and round keeps things fair; whatever
+        // is left over is reported again by the next epoll_wait().
+        ssize_t len = read(slot->fd, pool->buf, sizeof(pool->buf));
+        if (len > 0) {
+            // Without a batch or cursor, stopping early means an error.
+            if (jsonex_feed(&slot->context, pool->buf, len) < (size_t)len) {
+                release(pool, slot, jsonex_strerror(slot->context.error));
+            }
+        } else if (len == 0) {
+            release(pool, slot, jsonex_finish(&slot->context));
+        } else if (errno != EINTR && errno != EAGAIN) {
+            release(pool, slot, "read failed");
+        }
+    }
+    return NULL;
+}
+
+void jsonex_pool_destroy(jsonex_pool_t *pool) {
+    for (size_t i = 0; i < pool->slots_len; i++) {
+        if (pool->slots[i].fd >= 0) {
+            close(pool->slots[i].fd);
+            pool->slots[i].fd = -1;
+        }
+    }
+    close(pool->epoll_fd);
+}
@@ -0,0 +1,42 @@
+#ifndef __JSONEX_POOL_H__
+#define __JSONEX_POOL_H__
+
+#include "jsonex.h"
+
+#define JSONEX_POOL_READ_SIZE 4096
+#define JSONEX_POOL_EVENT_COUNT 64
+
+struct jsonex_pool;
+struct jsonex_pool_slot;
+
+// Called with the slot whose record (or connection) just completed. The error
+// is NULL on success.
+typedef void (*jsonex_pool_fn_t)(struct jsonex_pool_slot *, const char *);
+
+typedef struct jsonex_pool_slot {
+    // Set up once with jsonex_init(); the pool only ever resets it.
+    jsonex_context_t context;
+    int fd;
+    void *user;
+    struct jsonex_pool *pool;
+    struct jsonex_pool_slot *next_free;
+} jsonex_pool_slot_t;
+
+typedef struct jsonex_pool {
+    jsonex_pool_slot_t *slots;
+    size_t slots_len;
+    jsonex_pool_slot_t *free;
+    int epoll_fd;
+    jsonex_pool_fn_t record_fn;
+    jsonex_pool_fn_t close_fn;
+    char buf[JSONEX_POOL_READ_SIZE];
+} jsonex_pool_t;
+
+const char *jsonex_pool_init(jsonex_pool_t *, jsonex_pool_slot_t *, size_t, jsonex_pool_fn_t, jsonex_pool_fn_t);
+// Returns NULL if no slot is free, or if the next one's context stores into a
+// batch or feeds a cursor, since those stop early with no one to resume them.
+jsonex_pool_slot_t *jsonex_pool_add(jsonex_pool_t *, int, void *);
+const char *jsonex_pool_run(jsonex_pool_t *, int);
+void jsonex_pool_destroy(jsonex_pool_t *);
+
+#endif
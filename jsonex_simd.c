@@ -0,0 +1,329 @@
+#include <string.h>
+
+#include "jsonex_simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define JSONEX_X86 1
+    #include <immintrin.h>
+#endif
+
+#define WHITESPACE 1
+#define STRUCTURAL 2
+#define QUOTE 4
+#define BACKSLASH 8
+
+static const unsigned char classes[256] = {
+    [' '] = WHITESPACE,
+    ['\n'] = WHITESPACE,
+    ['\r'] = WHITESPACE,
+    ['\t'] = WHITESPACE,
+    ['{'] = STRUCTURAL,
+    ['}'] = STRUCTURAL,
+    ['['] = STRUCTURAL,
+    [']'] = STRUCTURAL,
+    [':'] = STRUCTURAL,
+    [','] = STRUCTURAL,
+    ['"'] = QUOTE,
+    ['\\'] = BACKSLASH
+};
+
+static void classify_scalar(const char *block, jsonex_masks_t *masks) {
+    memset(masks, 0, sizeof(*masks));
+    for (int i = 0; i < 64; i++) {
+        unsigned char c = classes[(unsigned char)block[i]];
+        uint64_t bit = (uint64_t)1 << i;
+        if (c & WHITESPACE) {
+            masks->whitespace |= bit;
+        }
+        if (c & STRUCTURAL) {
+            masks->structural |= bit;
+        }
+        if (c & QUOTE) {
+            masks->quote |= bit;
+        }
+        if (c & BACKSLASH) {
+            masks->backslash |= bit;
+        }
+        if ((unsigned char)block[i] < 0x20) {
+            masks->control |= bit;
+        }
+    }
+}
+
+#if JSONEX_X86
+
+#define SIDD_ANY (_SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK)
+#define SIDD_RANGES (_SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_BIT_MASK)
+
+__attribute__((target("sse4.2")))
+static void classify_sse42(const char *block, jsonex_masks_t *masks) {
+    // pcmpestrm takes explicit lengths, so NUL bytes in the input are fine.
+    const __m128i whitespace = _mm_setr_epi8(' ', '\n', '\r', '\t', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i structural = _mm_setr_epi8('{', '}', '[', ']', ':', ',', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_setr_epi8(0x00, 0x1f, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+    memset(masks, 0, sizeof(*masks));
+    for (int i = 0; i < 4; i++) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(block + 16 * i));
+        int shift = 16 * i;
+        masks->whitespace |= (uint64_t)(uint16_t)_mm_cvtsi128_si32(_mm_cmpestrm(whitespace, 4, x, 16, SIDD_ANY)) << shift;
+        masks->structural |= (uint64_t)(uint16_t)_mm_cvtsi128_si32(_mm_cmpestrm(structural, 6, x, 16, SIDD_ANY)) << shift;
+        masks->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, quote)) << shift;
+        masks->backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, backslash)) << shift;
+        masks->control |= (uint64_t)(uint16_t)_mm_cvtsi128_si32(_mm_cmpestrm(control, 2, x, 16, SIDD_RANGES)) << shift;
+    }
+}
+
+__attribute__((target("avx2")))
+static uint32_t eq_avx2(__m256i x, char c) {
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(c)));
+}
+
+__attribute__((target("avx2")))
+static void classify_avx2(const char *block, jsonex_masks_t *masks) {
+    memset(masks, 0, sizeof(*masks));
+    for (int i = 0; i < 2; i++) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(block + 32 * i));
+        int shift = 32 * i;
+        uint32_t whitespace = eq_avx2(x, ' ') | eq_avx2(x, '\n') | eq_avx2(x, '\r') | eq_avx2(x, '\t');
+        uint32_t structural = eq_avx2(x, '{') | eq_avx2(x, '}') | eq_avx2(x, '[') | eq_avx2(x, ']') |
+            eq_avx2(x, ':') | eq_avx2(x, ',');
+        // Unsigned x <= 0x1f iff min(x, 0x1f) == x.
+        __m256i low = _mm256_min_epu8(x, _mm256_set1_epi8(0x1f));
+        uint32_t control = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, x));
+
+        masks->whitespace |= (uint64_t)whitespace << shift;
+        masks->structural |= (uint64_t)structural << shift;
+        masks->quote |= (uint64_t)eq_avx2(x, '"') << shift;
+        masks->backslash |= (uint64_t)eq_avx2(x, '\\') << shift;
+        masks->control |= (uint64_t)control << shift;
+    }
+}
+
+__attribute__((target("avx512bw")))
+static void classify_avx512(const char *block, jsonex_masks_t *masks) {
+    __m512i x = _mm512_loadu_si512((const void *)block);
+    #define EQ(c) ((uint64_t)_mm512_cmpeq_epi8_mask(x, _mm512_set1_epi8(c)))
+    masks->whitespace = EQ(' ') | EQ('\n') | EQ('\r') | EQ('\t');
+    masks->structural = EQ('{') | EQ('}') | EQ('[') | EQ(']') | EQ(':') | EQ(',');
+    masks->quote = EQ('"');
+    masks->backslash = EQ('\\');
+    masks->control = (uint64_t)_mm512_cmplt_epu8_mask(x, _mm512_set1_epi8(0x20));
+    #undef EQ
+}
+
+#endif
+
+jsonex_classify_fn_t jsonex_kernel(const char *name) {
+    if (strcmp(name, "scalar") == 0) {
+        return classify_scalar;
+    }
+#if JSONEX_X86
+    // __builtin_cpu_supports() looks at cpuid, and for AVX also checks that
+    // the OS saves the wider registers.
+    __builtin_cpu_init();
+    if (strcmp(name, "sse42") == 0 && __builtin_cpu_supports("sse4.2")) {
+        return classify_sse42;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        return classify_avx2;
+    }
+    if (strcmp(name, "avx512") == 0 && __builtin_cpu_supports("avx512bw")) {
+        return classify_avx512;
+    }
+#endif
+    return NULL;
+}
+
+jsonex_classify_fn_t jsonex_best_kernel(void) {
+    static const char *names[] = { "avx512", "avx2", "sse42", "scalar" };
+    jsonex_classify_fn_t best = NULL;
+    for (int i = 0; best == NULL; i++) {
+        best = jsonex_kernel(names[i]);
+    }
+    return best;
+}
+
+const unsigned char jsonex_base64_values[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x40, 0x40, 0xff, 0xff, 0x40, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0x40, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0x3e, 0xff, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0x40, 0xff, 0xff,
+    0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0x3f,
+    0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+static size_t base64_scalar(const char *s, size_t n, char *out) {
+    const unsigned char *u = (const unsigned char *)s;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        unsigned char a = jsonex_base64_values[u[i]], b = jsonex_base64_values[u[i + 1]];
+        unsigned char c = jsonex_base64_values[u[i + 2]], d = jsonex_base64_values[u[i + 3]];
+        if ((a | b | c | d) & 0xc0) {
+            break;
+        }
+        uint32_t bits = (uint32_t)a << 18 | (uint32_t)b << 12 | c << 6 | d;
+        *out++ = (char)(bits >> 16);
+        *out++ = (char)(bits >> 8);
+        *out++ = (char)bits;
+    }
+    return i;
+}
+
+#if JSONEX_X86
+
+// Both kernels map each character to its sextet by ranges ('A'-'Z', 'a'-'z',
+// '0'-'9', then "+-" and "/_"), so that either alphabet goes through. A
+// vector with anything else in it is left to base64_scalar(), which stops at
+// the first group that isn't whole.
+
+__attribute__((target("sse4.2")))
+static __m128i in_range_sse42(__m128i x, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8(lo - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8(hi + 1)));
+}
+
+__attribute__((target("sse4.2")))
+static size_t base64_sse42(const char *s, size_t n, char *out) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16, out += 12) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i upper = in_range_sse42(x, 'A', 'Z');
+        __m128i lower = in_range_sse42(x, 'a', 'z');
+        __m128i digit = in_range_sse42(x, '0', '9');
+        __m128i plus = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('+')), _mm_cmpeq_epi8(x, _mm_set1_epi8('-')));
+        __m128i slash = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('/')), _mm_cmpeq_epi8(x, _mm_set1_epi8('_')));
+        __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, _mm_or_si128(plus, slash)));
+        if (_mm_movemask_epi8(valid) != 0xffff) {
+            break;
+        }
+
+        __m128i delta = _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')),
+            _mm_or_si128(_mm_and_si128(lower, _mm_set1_epi8(26 - 'a')), _mm_and_si128(digit, _mm_set1_epi8(52 - '0'))));
+        __m128i sextets = _mm_add_epi8(x, delta);
+        sextets = _mm_blendv_epi8(sextets, _mm_set1_epi8(62), plus);
+        sextets = _mm_blendv_epi8(sextets, _mm_set1_epi8(63), slash);
+
+        // Pairs of sextets into 12 bits, pairs of those into 24, then the
+        // three bytes of each group in order, big end first.
+        __m128i pairs = _mm_maddubs_epi16(sextets, _mm_set1_epi32(0x01400140));
+        __m128i groups = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+        __m128i bytes = _mm_shuffle_epi8(groups, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        _mm_storeu_si128((__m128i *)out, bytes);
+    }
+    return i + base64_scalar(s + i, n - i, out);
+}
+
+__attribute__((target("avx2")))
+static __m256i in_range_avx2(__m256i x, char lo, char hi) {
+    return _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8(lo - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), x));
+}
+
+__attribute__((target("avx2")))
+static size_t base64_avx2(const char *s, size_t n, char *out) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32, out += 24) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i upper = in_range_avx2(x, 'A', 'Z');
+        __m256i lower = in_range_avx2(x, 'a', 'z');
+        __m256i digit = in_range_avx2(x, '0', '9');
+        __m256i plus = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('+')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('-')));
+        __m256i slash = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('/')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('_')));
+        __m256i valid = _mm256_or_si256(_mm256_or_si256(upper, lower), _mm256_or_si256(digit, _mm256_or_si256(plus, slash)));
+        if ((uint32_t)_mm256_movemask_epi8(valid) != 0xffffffff) {
+            break;
+        }
+
+        __m256i delta = _mm256_or_si256(_mm256_and_si256(upper, _mm256_set1_epi8(-'A')),
+            _mm256_or_si256(_mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a')), _mm256_and_si256(digit, _mm256_set1_epi8(52 - '0'))));
+        __m256i sextets = _mm256_add_epi8(x, delta);
+        sextets = _mm256_blendv_epi8(sextets, _mm256_set1_epi8(62), plus);
+        sextets = _mm256_blendv_epi8(sextets, _mm256_set1_epi8(63), slash);
+
+        // As in base64_sse42(), in each half, then the two halves' 12 bytes
+        // next to each other.
+        __m256i pairs = _mm256_maddubs_epi16(sextets, _mm256_set1_epi32(0x01400140));
+        __m256i groups = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+        __m256i bytes = _mm256_shuffle_epi8(groups, _mm256_setr_epi8(
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        bytes = _mm256_permutevar8x32_epi32(bytes, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        _mm256_storeu_si256((__m256i *)out, bytes);
+    }
+    return i + base64_scalar(s + i, n - i, out);
+}
+
+#endif
+
+jsonex_base64_fn_t jsonex_base64_kernel(const char *name) {
+    if (strcmp(name, "scalar") == 0) {
+        return base64_scalar;
+    }
+#if JSONEX_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "sse42") == 0 && __builtin_cpu_supports("sse4.2")) {
+        return base64_sse42;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        return base64_avx2;
+    }
+#endif
+    return NULL;
+}
+
+jsonex_base64_fn_t jsonex_best_base64_kernel(void) {
+    // jsonex_feed() hands strings over at most 64 bytes at a time, which is
+    // only two steps of the AVX2 kernel, so AVX-512 wouldn't buy much.
+    static const char *names[] = { "avx2", "sse42", "scalar" };
+    jsonex_base64_fn_t best = NULL;
+    for (int i = 0; best == NULL; i++) {
+        best = jsonex_base64_kernel(names[i]);
+    }
+    return best;
+}
+
+uint64_t jsonex_strings(jsonex_masks_t *masks, uint64_t *escaped, uint64_t *in_string) {
+    // A backslash escapes the next byte, unless it is escaped itself.
+    // Backslashes are rare, so just walk them in order.
+    uint64_t escapes = *escaped;
+    uint64_t backslash = masks->backslash;
+    *escaped = 0;
+    while (backslash) {
+        uint64_t bit = backslash & -backslash;
+        backslash ^= bit;
+        if (escapes & bit) {
+            continue;
+        }
+        if (bit == (uint64_t)1 << 63) {
+            *escaped = 1;
+        } else {
+            escapes |= bit << 1;
+        }
+    }
+    masks->quote &= ~escapes;
+
+    // Every quote toggles whether we're in a string: a prefix XOR.
+    uint64_t strings = masks->quote;
+    strings ^= strings << 1;
+    strings ^= strings << 2;
+    strings ^= strings << 4;
+    strings ^= strings << 8;
+    strings ^= strings << 16;
+    strings ^= strings << 32;
+    if (*in_string) {
+        strings = ~strings;
+    }
+    *in_string = strings >> 63;
+    return strings;
+}
@@ -0,0 +1,68 @@
+#ifndef __JSONEX_SIMD_H__
+#define __JSONEX_SIMD_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Classification of a 64 byte block. Bit i of each mask describes byte i.
+typedef struct {
+    uint64_t whitespace;
+    // {}[]:,
+    uint64_t structural;
+    uint64_t quote;
+    uint64_t backslash;
+    // Bytes below 0x20, which may not appear raw inside a string.
+    uint64_t control;
+} jsonex_masks_t;
+
+typedef void (*jsonex_classify_fn_t)(const char *, jsonex_masks_t *);
+
+// Returns the named kernel ("scalar", "sse42", "avx2" or "avx512"), or NULL if
+// it isn't available on this CPU.
+jsonex_classify_fn_t jsonex_kernel(const char *);
+// Returns the fastest kernel available on this CPU. Nothing is cached, so it
+// is safe to call from any thread, but it is slow enough to call once and
+// keep the result.
+jsonex_classify_fn_t jsonex_best_kernel(void);
+
+// The sextet of each character in the base64 alphabet, or in the URL-safe
+// one; JSONEX_BASE64_SKIP for whitespace and padding, JSONEX_BASE64_BAD for
+// anything else.
+#define JSONEX_BASE64_SKIP 0x40
+#define JSONEX_BASE64_BAD 0xff
+extern const unsigned char jsonex_base64_values[256];
+
+// Decodes whole groups of four characters from the start of s into three bytes
+// each, for as long as they are all in the alphabet, and returns how many
+// characters that was. Up to JSONEX_BASE64_SLACK bytes past the decoded ones
+// may be written to out.
+#define JSONEX_BASE64_SLACK 8
+typedef size_t (*jsonex_base64_fn_t)(const char *s, size_t n, char *out);
+
+// Returns the named decode kernel ("scalar", "sse42" or "avx2"), or NULL if
+// it isn't available on this CPU.
+jsonex_base64_fn_t jsonex_base64_kernel(const char *);
+// Returns the fastest decode kernel available on this CPU. Like
+// jsonex_best_kernel(), it caches nothing.
+jsonex_base64_fn_t jsonex_best_base64_kernel(void);
+
+// Drops escaped quotes from masks->quote and returns the bytes inside strings
+// (from an opening quote up to, but not including, its closing quote).
+// *escaped and *in_string carry the state from one block to the next, and
+// should start at 0.
+uint64_t jsonex_strings(jsonex_masks_t *, uint64_t *escaped, uint64_t *in_string);
+
+// Returns the index of the lowest set bit, or 64 if there is none.
+static inline int jsonex_first_bit(uint64_t x) {
+#if defined(__GNUC__)
+    return x ? __builtin_ctzll(x) : 64;
+#else
+    int i = 0;
+    while (i < 64 && !(x & ((uint64_t)1 << i))) {
+        i++;
+    }
+    return i;
+#endif
+}
+
+#endif
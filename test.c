@@ -1,14 +1,18 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #include "jsonex.h"
+#include "jsonex_index.h"
+#include "jsonex_pool.h"
+#include "jsonex_simd.h"
 
-void run(char *fn, jsonex_rule_t *rules) {
-    jsonex_context_t context;
-    jsonex_init(&context, rules);
-
+void run_context(jsonex_context_t *context, char *fn) {
     FILE *f = fopen(fn, "r");
     if (f == NULL) {
         perror("fopen");
@@ -17,17 +21,24 @@ void run(char *fn, jsonex_rule_t *rules) {
 
     int c;
     while ((c = fgetc(f)) != EOF) {
-        if (!jsonex_call(&context, c)) {
+        if (!jsonex_call(context, c)) {
             printf("%s: jsonex_call() failed\n", fn);
             exit(1);
         }
     }
 
     const char *ret;
-    if ((ret = jsonex_finish(&context)) != NULL) {
+    if ((ret = jsonex_finish(context)) != NULL) {
         printf("jsonex_finish() during %s: %s\n", fn, ret);
         exit(1);
     }
+    fclose(f);
+}
+
+void run(char *fn, jsonex_rule_t *rules) {
+    jsonex_context_t context;
+    jsonex_init(&context, rules);
+    run_context(&context, fn);
 }
 
 #define CHECK_INTEGER(a, b) \
@@ -42,6 +53,109 @@ void run(char *fn, jsonex_rule_t *rules) {
         exit(1); \
     }
 
+struct records {
+    int count;
+    int codes[8];
+    char msgs[8][JSONEX_MAX_STRING_SIZE];
+    int *code;
+    char *msg;
+};
+
+void collect_record(jsonex_context_t *context, const char *error, void *user) {
+    struct records *records = user;
+    if (error != NULL) {
+        printf("record %i: %s\n", records->count, error);
+        exit(1);
+    }
+    records->codes[records->count] = *(records->code);
+    strcpy(records->msgs[records->count], records->msg);
+    records->count++;
+}
+
+struct sink {
+    char data[1024];
+    size_t len;
+    size_t chunks;
+    int ended;
+};
+
+void sink_write(jsonex_context_t *context, const char *s, size_t n, void *user) {
+    struct sink *sink = user;
+    if (n == 0) {
+        sink->ended++;
+        return;
+    }
+    if (sink->ended || n > JSONEX_STREAM_CHUNK_SIZE || sink->len + n > sizeof(sink->data)) {
+        puts("sink_write() got a bad chunk");
+        exit(1);
+    }
+    memcpy(sink->data + sink->len, s, n);
+    sink->len += n;
+    sink->chunks++;
+}
+
+size_t read_file(char *fn, char *buf, size_t size) {
+    FILE *f = fopen(fn, "r");
+    if (f == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    size_t len = fread(buf, 1, size, f);
+    fclose(f);
+    return len;
+}
+
+#define CHECK_MASK(a, b, name) \
+    if (a != b) { \
+        printf(#a " differs from the scalar kernel in %s\n", name); \
+        exit(1); \
+    }
+
+struct outcomes {
+    int count;
+    jsonex_error_t errors[8];
+    size_t lines[8];
+    size_t columns[8];
+};
+
+void collect_outcome(jsonex_context_t *context, const char *error, void *user) {
+    struct outcomes *outcomes = user;
+    outcomes->errors[outcomes->count] = context->error;
+    outcomes->lines[outcomes->count] = context->error_line;
+    outcomes->columns[outcomes->count] = context->error_column;
+    outcomes->count++;
+}
+
+struct connection {
+    int id;
+    int records;
+    int closed;
+    const char *error;
+    jsonex_rule_t rules[2];
+};
+
+void pool_record(jsonex_pool_slot_t *slot, const char *error) {
+    struct connection *connection = slot->user;
+    if (error != NULL) {
+        printf("pool record: %s\n", error);
+        exit(1);
+    }
+    connection->records++;
+}
+
+void pool_close(jsonex_pool_slot_t *slot, const char *error) {
+    struct connection *connection = slot->user;
+    connection->closed = 1;
+    connection->error = error;
+}
+
+void write_string(int fd, const char *s) {
+    if (write(fd, s, strlen(s)) != strlen(s)) {
+        perror("write");
+        exit(1);
+    }
+}
+
 int main(void) {
     {
         int bloop = 0;
@@ -85,5 +199,1326 @@ int main(void) {
         CHECK_INTEGER(pooh, 4);
     }
 
+    {
+        int ts = 0;
+        char level[JSONEX_MAX_STRING_SIZE] = "";
+        int user_id = -1;
+
+        jsonex_rule_t rules[] = {
+            {
+                .type = JSONEX_INTEGER,
+                .p = &ts,
+                .found = NULL,
+                .path = (char *[]){ "ts", NULL }
+            },
+            {
+                .type = JSONEX_STRING,
+                .p = level,
+                .found = NULL,
+                .path = (char *[]){ "level", NULL },
+                .filter = JSONEX_FILTER_EQUALS,
+                .filter_string = "error"
+            },
+            {
+                .type = JSONEX_INTEGER,
+                .p = &user_id,
+                .found = NULL,
+                .path = (char *[]){ "user", "id", NULL }
+            },
+            { .type = JSONEX_NONE }
+        };
+        char *fn = "tests/2.json";
+        jsonex_context_t context;
+        jsonex_init(&context, rules);
+        run_context(&context, fn);
+
+        CHECK_INTEGER(context.rejected, 1);
+        CHECK_INTEGER(ts, 17);
+        CHECK_STRING(level, "");
+        CHECK_INTEGER(user_id, -1);
+    }
+
+    {
+        int code = 0;
+        char msg[JSONEX_MAX_STRING_SIZE] = "";
+        struct records records = { .count = 0, .code = &code, .msg = msg };
+
+        jsonex_rule_t rules[] = {
+            {
+                .type = JSONEX_STRING,
+                .p = NULL,
+                .found = NULL,
+                .path = (char *[]){ "level", NULL },
+                .filter = JSONEX_FILTER_PREFIX,
+                .filter_string = "err"
+            },
+            {
+                .type = JSONEX_INTEGER,
+                .p = &code,
+                .found = NULL,
+                .path = (char *[]){ "code", NULL },
+                .filter = JSONEX_FILTER_RANGE,
+                .filter_min = -100,
+                .filter_max = 100
+            },
+            {
+                .type = JSONEX_STRING,
+                .p = msg,
+                .found = NULL,
+                .path = (char *[]){ "msg", NULL }
+            },
+            { .type = JSONEX_NONE }
+        };
+        char *fn = "tests/3.ndjson";
+        jsonex_context_t context;
+        jsonex_init(&context, rules);
+        jsonex_ndjson(&context, collect_record, &records);
+        run_context(&context, fn);
+
+        CHECK_INTEGER(records.count, 2);
+        CHECK_INTEGER(records.codes[0], -7);
+        CHECK_STRING(records.msgs[0], "disk full");
+        CHECK_INTEGER(records.codes[1], -2);
+        CHECK_STRING(records.msgs[1], "eof");
+    }
+
+    {
+        // One compiled ruleset, two contexts fed alternately.
+        const jsonex_rule_t rules[] = {
+            {
+                .type = JSONEX_STRING,
+                .path = (char *[]){ "user", "name", NULL }
+            },
+            {
+                .type = JSONEX_INTEGER,
+                .path = (char *[]){ "user", "id", NULL }
+            },
+            {
+                .type = JSONEX_BOOL,
+                .found = (int[]){ 0 },
+                .path = (char *[]){ "admin", NULL }
+            },
+            { .type = JSONEX_NONE }
+        };
+        jsonex_ruleset_t ruleset;
+        const char *ret;
+        if ((ret = jsonex_compile(&ruleset, rules)) != NULL) {
+            printf("jsonex_compile(): %s\n", ret);
+            exit(1);
+        }
+
+        char names[2][JSONEX_MAX_STRING_SIZE];
+        int ids[2], admins[2] = { -1, -1 }, admin_found[2];
+        char *fns[2] = { "tests/5.json", "tests/6.json" };
+        char bufs[2][256];
+        size_t lens[2];
+        jsonex_context_t contexts[2];
+        for (int i = 0; i < 2; i++) {
+            lens[i] = read_file(fns[i], bufs[i], sizeof(bufs[i]));
+            jsonex_init_ruleset(&contexts[i], &ruleset);
+            jsonex_bind(&contexts[i], 0, names[i], NULL);
+            jsonex_bind(&contexts[i], 1, &ids[i], NULL);
+            jsonex_bind(&contexts[i], 2, &admins[i], &admin_found[i]);
+        }
+        for (size_t j = 0; j < lens[0] || j < lens[1]; j++) {
+            for (int i = 0; i < 2; i++) {
+                if (j < lens[i] && !jsonex_call(&contexts[i], bufs[i][j])) {
+                    printf("%s: jsonex_call() failed\n", fns[i]);
+                    exit(1);
+                }
+            }
+        }
+        for (int i = 0; i < 2; i++) {
+            if ((ret = jsonex_finish(&contexts[i])) != NULL) {
+                printf("jsonex_finish() during %s: %s\n", fns[i], ret);
+                exit(1);
+            }
+        }
+
+        char *fn = "ruleset";
+        CHECK_STRING(names[0], "ada");
+        CHECK_INTEGER(ids[0], 36);
+        CHECK_INTEGER(admins[0], 1);
+        CHECK_INTEGER(admin_found[0], 1);
+        CHECK_STRING(names[1], "grace");
+        CHECK_INTEGER(ids[1], 37);
+        CHECK_INTEGER(admins[1], -1);
+        CHECK_INTEGER(admin_found[1], 0);
+        CHECK_INTEGER(jsonex_found(&contexts[1], 2), 0);
+        CHECK_INTEGER((rules[0].found == NULL), 1);
+
+        jsonex_rule_t bad[] = {
+            {
+                .type = JSONEX_INTEGER,
+                .path = (char *[]){ "level", NULL },
+                .filter = JSONEX_FILTER_EQUALS,
+                .filter_string = "error"
+            },
+            { .type = JSONEX_NONE }
+        };
+        CHECK_INTEGER((jsonex_compile(&ruleset, bad) != NULL), 1);
+
+        // Rules that didn't compile fail every input, even after a reset.
+        int a = 0;
+        jsonex_rule_t half_bad[] = {
+            {
+                .type = JSONEX_INTEGER,
+                .p = &a,
+                .found = NULL,
+                .path = (char *[]){ "a", NULL }
+            },
+            bad[0],
+            { .type = JSONEX_NONE }
+        };
+        jsonex_context_t context;
+        CHECK_STRING(jsonex_init(&context, half_bad), "string filter needs a JSONEX_STRING rule and filter_string");
+        jsonex_reset(&context);
+        const char *s = "{\"a\": 5}";
+        jsonex_feed(&context, s, strlen(s));
+        CHECK_STRING(jsonex_finish(&context), "bad rules");
+        CHECK_INTEGER(a, 0);
+    }
+
+    {
+        char *fn = "error position";
+        jsonex_rule_t rules[] = { { .type = JSONEX_NONE } };
+        char input[] = "{\n  \"a\": 1,\n  \"b\": x\n}";
+        jsonex_context_t context;
+        jsonex_init(&context, rules);
+        jsonex_options(&context, JSONEX_TRACK_LINES);
+        size_t consumed = jsonex_feed(&context, input, sizeof(input) - 1);
+        CHECK_INTEGER((int)consumed, 19);
+        CHECK_INTEGER(context.error, JSONEX_ERROR_SYNTAX);
+        CHECK_INTEGER((int)context.error_offset, 19);
+        CHECK_INTEGER((int)context.error_line, 3);
+        CHECK_INTEGER((int)context.error_column, 8);
+        CHECK_STRING(jsonex_finish(&context), "did not parse");
+
+        jsonex_init(&context, rules);
+        for (int i = 0; i < 7; i++) {
+            jsonex_call(&context, input[i]);
+        }
+        CHECK_STRING(jsonex_finish(&context), "input ended inside a value");
+        CHECK_INTEGER(context.error, JSONEX_ERROR_TRUNCATED);
+        CHECK_INTEGER((int)context.error_offset, 7);
+    }
+
+    {
+        // Broken records are reported and skipped, whether fed by the
+        // character or by the buffer.
+        char *fn = "tests/7.ndjson";
+        char buf[512];
+        size_t len = read_file(fn, buf, sizeof(buf));
+        for (int k = 0; k < 2; k++) {
+            int id;
+            jsonex_rule_t rules[] = {
+                {
+                    .type = JSONEX_INTEGER,
+                    .p = &id,
+                    .found = NULL,
+                    .path = (char *[]){ "id", NULL }
+                },
+                { .type = JSONEX_NONE }
+            };
+            struct outcomes outcomes = { .count = 0 };
+            jsonex_context_t context;
+            jsonex_init(&context, rules);
+            jsonex_ndjson(&context, collect_outcome, &outcomes);
+            jsonex_options(&context, JSONEX_TRACK_LINES | JSONEX_RESYNC);
+            if (k == 0) {
+                CHECK_INTEGER((int)jsonex_feed(&context, buf, len), (int)len);
+            } else {
+                for (size_t i = 0; i < len; i++) {
+                    CHECK_INTEGER(jsonex_call(&context, buf[i]), 1);
+                }
+            }
+            CHECK_INTEGER((jsonex_finish(&context) == NULL), 1);
+
+            CHECK_INTEGER(outcomes.count, 7);
+            CHECK_INTEGER(outcomes.errors[0], JSONEX_OK);
+            CHECK_INTEGER(outcomes.errors[1], JSONEX_ERROR_SYNTAX);
+            CHECK_INTEGER((int)outcomes.lines[1], 2);
+            CHECK_INTEGER((int)outcomes.columns[1], 11);
+            CHECK_INTEGER(outcomes.errors[2], JSONEX_OK);
+            // The long string isn't an integer, so it is skipped whole.
+            CHECK_INTEGER(outcomes.errors[3], JSONEX_ERROR_MISSING_RULE);
+            CHECK_INTEGER((int)outcomes.lines[3], 4);
+            CHECK_INTEGER(outcomes.errors[4], JSONEX_ERROR_TRUNCATED);
+            CHECK_INTEGER((int)outcomes.lines[4], 5);
+            CHECK_INTEGER(outcomes.errors[5], JSONEX_OK);
+            CHECK_INTEGER(outcomes.errors[6], JSONEX_ERROR_TRUNCATED);
+            CHECK_INTEGER(id, 6);
+        }
+    }
+
+    {
+        // A string too long for a frame only matters if it is kept.
+        char *fn = "long strings";
+        char level[JSONEX_MAX_STRING_SIZE];
+        char msg[JSONEX_MAX_STRING_SIZE];
+        char s[128];
+        strcpy(s, "{\"level\":\"info\",\"msg\":\"");
+        memset(s + strlen(s), 'a', 86);
+        strcpy(s + 108, "\"}");
+        for (int k = 0; k < 2; k++) {
+            jsonex_rule_t rules[] = {
+                {
+                    .type = JSONEX_STRING,
+                    .p = level,
+                    .found = NULL,
+                    .path = (char *[]){ "level", NULL }
+                },
+                {
+                    .type = JSONEX_STRING,
+                    .p = msg,
+                    .found = NULL,
+                    .path = (char *[]){ "msg", NULL }
+                },
+                { .type = JSONEX_NONE }
+            };
+            if (k == 0) {
+                rules[1].type = JSONEX_NONE;
+            }
+            jsonex_context_t context;
+            jsonex_init(&context, rules);
+            size_t used = jsonex_feed(&context, s, strlen(s));
+            if (k == 0) {
+                CHECK_INTEGER((int)used, (int)strlen(s));
+                CHECK_INTEGER((jsonex_finish(&context) == NULL), 1);
+                CHECK_STRING(level, "info");
+            } else {
+                CHECK_INTEGER((int)context.error_offset, 86);
+                CHECK_STRING(jsonex_finish(&context), "string too long");
+            }
+        }
+    }
+
+    {
+        // Batches of two rows, emptied into plain arrays whenever full.
+        char *fn = "tests/8.ndjson";
+        char buf[512];
+        size_t len = read_file(fn, buf, sizeof(buf));
+
+        const jsonex_rule_t rules[] = {
+            {
+                .type = JSONEX_INTEGER,
+                .path = (char *[]){ "ts", NULL }
+            },
+            {
+                .type = JSONEX_STRING,
+                .path = (char *[]){ "host", NULL }
+            },
+            {
+                .type = JSONEX_BOOL,
+                .path = (char *[]){ "ok", NULL }
+            },
+            {
+                .type = JSONEX_STRING,
+                .found = (int[]){ 0 },
+                .path = (char *[]){ "level", NULL },
+                .filter = JSONEX_FILTER_PREFIX,
+                .filter_string = "err"
+            },
+            { .type = JSONEX_NONE }
+        };
+        jsonex_ruleset_t ruleset;
+        jsonex_compile(&ruleset, rules);
+
+        int ts[2], ok[2];
+        uint32_t host_offsets[3];
+        char host_data[256];
+        unsigned char validity[3][1];
+        jsonex_column_t columns[4] = {
+            { .values = ts, .validity = validity[0] },
+            { .offsets = host_offsets, .data = host_data, .data_size = sizeof(host_data), .validity = validity[1] },
+            { .values = ok, .validity = validity[2] },
+            { .values = NULL }
+        };
+        jsonex_batch_t batch = { .columns = columns, .capacity = 2, .rows = 0 };
+
+        int all_ts[8], all_ok[8], all_valid[8][3];
+        char all_hosts[8][JSONEX_MAX_STRING_SIZE];
+        int rows = 0;
+
+        jsonex_context_t context;
+        jsonex_init_ruleset(&context, &ruleset);
+        jsonex_batch(&context, &batch);
+        jsonex_options(&context, JSONEX_RESYNC);
+        size_t i = 0;
+        for (int done = 0; !done; ) {
+            if (i < len) {
+                i += jsonex_feed(&context, buf + i, len - i);
+                CHECK_INTEGER(context.error, JSONEX_OK);
+            } else {
+                CHECK_INTEGER((jsonex_finish(&context) == NULL), 1);
+                done = 1;
+            }
+            for (int row = 0; row < batch.rows; row++, rows++) {
+                all_ts[rows] = ts[row];
+                all_ok[rows] = ok[row];
+                size_t host_len = host_offsets[row + 1] - host_offsets[row];
+                memcpy(all_hosts[rows], host_data + host_offsets[row], host_len);
+                all_hosts[rows][host_len] = '\0';
+                for (int c = 0; c < 3; c++) {
+                    all_valid[rows][c] = (validity[c][0] >> row) & 1;
+                }
+            }
+            batch.rows = 0;
+        }
+
+        CHECK_INTEGER(rows, 4);
+        CHECK_INTEGER(all_ts[0], 1);
+        CHECK_STRING(all_hosts[0], "alpha");
+        CHECK_INTEGER(all_ok[0], 1);
+        CHECK_INTEGER(all_valid[0][1], 1);
+        CHECK_INTEGER(all_ts[1], 2);
+        CHECK_STRING(all_hosts[1], "");
+        CHECK_INTEGER(all_valid[1][1], 0);
+        CHECK_INTEGER(all_ok[1], 0);
+        CHECK_INTEGER(all_valid[1][2], 1);
+        CHECK_INTEGER(all_ts[2], 4);
+        CHECK_STRING(all_hosts[2], "epsilon");
+        CHECK_INTEGER(all_valid[2][2], 0);
+        CHECK_INTEGER(all_ts[3], 6);
+        CHECK_STRING(all_hosts[3], "zeta");
+        CHECK_INTEGER(all_ok[3], 1);
+    }
+
+    {
+        // Fed by the character, a batch that is full of strings fails the
+        // record rather than write past its data.
+        char *fn = "batch data";
+        const jsonex_rule_t rules[] = {
+            {
+                .type = JSONEX_STRING,
+                .path = (char *[]){ "host", NULL }
+            },
+            { .type = JSONEX_NONE }
+        };
+        jsonex_ruleset_t ruleset;
+        jsonex_compile(&ruleset, rules);
+
+        uint32_t offsets[5];
+        char data[71];
+        data[70] = '!';
+        jsonex_column_t columns[1] = {
+            { .offsets = offsets, .data = data, .data_size = 70 }
+        };
+        jsonex_batch_t batch = { .columns = columns, .capacity = 4, .rows = 0 };
+        char s[128];
+        memset(s, 'a', sizeof(s));
+        memcpy(s, "{\"host\":\"", 9);
+        memcpy(s + 49, "\"}\n{\"host\":\"", 12);
+        memcpy(s + 111, "\"}\n", 3);
+
+        jsonex_context_t context;
+        jsonex_init_ruleset(&context, &ruleset);
+        jsonex_batch(&context, &batch);
+        size_t i = 0;
+        while (i < 114 && jsonex_call(&context, s[i])) {
+            i++;
+        }
+        CHECK_INTEGER(context.error, JSONEX_ERROR_OUTPUT_FULL);
+        CHECK_INTEGER((int)batch.rows, 1);
+        CHECK_INTEGER((int)offsets[1], 40);
+        CHECK_INTEGER(data[70], '!');
+    }
+
+    {
+        // Compare every kernel this CPU has against the scalar one, on
+        // blocks made mostly of the characters they look for.
+        const char *alphabet = " \n\r\t{}[]:,\"\\\x01\x1f\x7f\x80\xff\0azAZ09";
+        jsonex_classify_fn_t scalar = jsonex_kernel("scalar");
+        const char *names[] = { "sse42", "avx2", "avx512" };
+        for (int k = 0; k < 3; k++) {
+            jsonex_classify_fn_t kernel = jsonex_kernel(names[k]);
+            if (kernel == NULL) {
+                printf("skipping kernel %s, not supported by this CPU\n", names[k]);
+                continue;
+            }
+            srand(1);
+            for (int n = 0; n < 1000; n++) {
+                char block[64];
+                for (int i = 0; i < 64; i++) {
+                    block[i] = alphabet[rand() % 23];
+                }
+                jsonex_masks_t expected, got;
+                scalar(block, &expected);
+                kernel(block, &got);
+                CHECK_MASK(got.whitespace, expected.whitespace, names[k]);
+                CHECK_MASK(got.structural, expected.structural, names[k]);
+                CHECK_MASK(got.quote, expected.quote, names[k]);
+                CHECK_MASK(got.backslash, expected.backslash, names[k]);
+                CHECK_MASK(got.control, expected.control, names[k]);
+            }
+        }
+    }
+
+    {
+        // The same for the base64 decode kernels, on strings mostly in the
+        // alphabet, so that they decode a while before they have to stop.
+        const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/-_";
+        const char others[] = "=:. \n\"\\@[`{\x80\xff";
+        jsonex_base64_fn_t scalar = jsonex_base64_kernel("scalar");
+        const char *names[] = { "sse42", "avx2" };
+        for (int k = 0; k < 2; k++) {
+            jsonex_base64_fn_t kernel = jsonex_base64_kernel(names[k]);
+            if (kernel == NULL) {
+                printf("skipping kernel %s, not supported by this CPU\n", names[k]);
+                continue;
+            }
+            srand(1);
+            for (int n = 0; n < 1000; n++) {
+                char s[100];
+                for (int i = 0; i < 100; i++) {
+                    s[i] = rand() % 64 ? alphabet[rand() % 66] : others[rand() % (sizeof(others) - 1)];
+                }
+                size_t len = rand() % 101;
+                char expected[75 + JSONEX_BASE64_SLACK], got[75 + JSONEX_BASE64_SLACK];
+                size_t expected_len = scalar(s, len, expected);
+                size_t got_len = kernel(s, len, got);
+                CHECK_MASK(got_len, expected_len, names[k]);
+                CHECK_MASK(memcmp(got, expected, expected_len / 4 * 3), 0, names[k]);
+            }
+        }
+    }
+
+    {
+        // A string whose escaped quote straddles two blocks.
+        char blocks[129];
+        memset(blocks, 'a', 128);
+        blocks[10] = '"';
+        blocks[63] = '\\';
+        blocks[64] = '"';
+        blocks[70] = '"';
+        blocks[71] = '[';
+        jsonex_masks_t masks;
+        uint64_t escaped = 0, in_string = 0;
+        jsonex_classify_fn_t classify = jsonex_best_kernel();
+
+        char *fn = "jsonex_strings";
+        classify(blocks, &masks);
+        uint64_t strings = jsonex_strings(&masks, &escaped, &in_string);
+        CHECK_INTEGER((strings == ~(uint64_t)0 << 10), 1);
+        CHECK_INTEGER((int)escaped, 1);
+        classify(blocks + 64, &masks);
+        strings = jsonex_strings(&masks, &escaped, &in_string);
+        CHECK_INTEGER((masks.quote == (uint64_t)1 << 6), 1);
+        CHECK_INTEGER((strings == ((uint64_t)1 << 6) - 1), 1);
+        CHECK_INTEGER((int)in_string, 0);
+    }
+
+    {
+        // A rejected record with a backslash outside its strings is skipped
+        // the same way by the character and by the block.
+        char *fn = "skipped backslash";
+        const char *s = "{\"level\":\"debug\",\"x\":[\\\"]}\n{\"level\":\"error\",\"code\":1,\"msg\":\"m\"}\n";
+        size_t len = strlen(s);
+        size_t chunks[] = { 0, 7, len };
+        for (int k = 0; k < 3; k++) {
+            int code = 0;
+            char msg[JSONEX_MAX_STRING_SIZE] = "";
+            struct records records = { .count = 0, .code = &code, .msg = msg };
+            jsonex_rule_t rules[] = {
+                {
+                    .type = JSONEX_STRING,
+                    .p = NULL,
+                    .found = NULL,
+                    .path = (char *[]){ "level", NULL },
+                    .filter = JSONEX_FILTER_EQUALS,
+                    .filter_string = "error"
+                },
+                {
+                    .type = JSONEX_INTEGER,
+                    .p = &code,
+                    .found = NULL,
+                    .path = (char *[]){ "code", NULL }
+                },
+                {
+                    .type = JSONEX_STRING,
+                    .p = msg,
+                    .found = NULL,
+                    .path = (char *[]){ "msg", NULL }
+                },
+                { .type = JSONEX_NONE }
+            };
+            jsonex_context_t context;
+            jsonex_init(&context, rules);
+            jsonex_ndjson(&context, collect_record, &records);
+            for (size_t i = 0; i < len; ) {
+                if (chunks[k] == 0) {
+                    CHECK_INTEGER(jsonex_call(&context, s[i]), 1);
+                    i++;
+                } else {
+                    size_t n = len - i < chunks[k] ? len - i : chunks[k];
+                    CHECK_INTEGER((int)jsonex_feed(&context, s + i, n), (int)n);
+                    i += n;
+                }
+            }
+            CHECK_INTEGER((jsonex_finish(&context) == NULL), 1);
+            CHECK_INTEGER(records.count, 1);
+            CHECK_INTEGER(records.codes[0], 1);
+        }
+    }
+
+    {
+        // The same stream, fed in chunks of different sizes, so that both
+        // skipping and strings cross block and buffer boundaries.
+        char *fn = "tests/4.ndjson";
+        char buf[4096];
+        size_t len = read_file(fn, buf, sizeof(buf));
+        size_t chunks[] = { 1, 5, 64, 100, sizeof(buf) };
+        for (int k = 0; k < 5; k++) {
+            int id = -1;
+            char msg[JSONEX_MAX_STRING_SIZE] = "";
+            struct records records = { .count = 0, .code = &id, .msg = msg };
+
+            jsonex_rule_t rules[] = {
+                {
+                    .type = JSONEX_STRING,
+                    .p = NULL,
+                    .found = NULL,
+                    .path = (char *[]){ "level", NULL },
+                    .filter = JSONEX_FILTER_EQUALS,
+                    .filter_string = "error"
+                },
+                {
+                    .type = JSONEX_INTEGER,
+                    .p = &id,
+                    .found = NULL,
+                    .path = (char *[]){ "id", NULL }
+                },
+                {
+                    .type = JSONEX_STRING,
+                    .p = msg,
+                    .found = NULL,
+                    .path = (char *[]){ "msg", NULL }
+                },
+                { .type = JSONEX_NONE }
+            };
+            jsonex_context_t context;
+            jsonex_init(&context, rules);
+            jsonex_ndjson(&context, collect_record, &records);
+            for (size_t i = 0; i < len; i += chunks[k]) {
+                size_t n = len - i < chunks[k] ? len - i : chunks[k];
+                if (jsonex_feed(&context, buf + i, n) != n) {
+                    printf("jsonex_feed() failed at %zu in chunks of %zu\n", i, chunks[k]);
+                    exit(1);
+                }
+            }
+            const char *ret;
+            if ((ret = jsonex_finish(&context)) != NULL) {
+                printf("jsonex_finish() during %s: %s\n", fn, ret);
+                exit(1);
+            }
+
+            CHECK_INTEGER(records.count, 2);
+            CHECK_INTEGER(records.codes[0], 1);
+            CHECK_STRING(records.msgs[0], "tab\tquote\" slash/ backslash\\ \\u00e9 zzzzzzzzzz");
+            CHECK_INTEGER(records.codes[1], 3);
+            CHECK_STRING(records.msgs[1], "mmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmm");
+        }
+    }
+
+    {
+        jsonex_pool_t pool;
+        jsonex_pool_slot_t slots[2];
+        struct connection connections[3];
+        int fds[3][2];
+
+        const char *ret;
+        if ((ret = jsonex_pool_init(&pool, slots, 2, pool_record, pool_close)) != NULL) {
+            puts(ret);
+            exit(1);
+        }
+        for (int i = 0; i < 3; i++) {
+            struct connection *connection = &connections[i];
+            connection->id = 0;
+            connection->records = 0;
+            connection->closed = 0;
+            connection->error = NULL;
+            connection->rules[0] = (jsonex_rule_t){
+                .type = JSONEX_INTEGER,
+                .p = &connection->id,
+                .found = NULL,
+                .path = (char *[]){ "id", NULL }
+            };
+            connection->rules[1] = (jsonex_rule_t){ .type = JSONEX_NONE };
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]) < 0) {
+                perror("socketpair");
+                exit(1);
+            }
+        }
+
+        // Each slot keeps its rules across connections, so give every slot
+        // the outputs of the connection it is going to serve.
+        jsonex_init(&slots[0].context, connections[0].rules);
+        jsonex_init(&slots[1].context, connections[1].rules);
+        if (jsonex_pool_add(&pool, fds[0][0], &connections[0]) != &slots[0] ||
+                jsonex_pool_add(&pool, fds[1][0], &connections[1]) != &slots[1] ||
+                jsonex_pool_add(&pool, fds[2][0], &connections[2]) != NULL) {
+            puts("jsonex_pool_add() handed out the wrong slots");
+            exit(1);
+        }
+
+        // Records split across reads.
+        write_string(fds[0][1], "{\"id\": 1");
+        write_string(fds[1][1], "{\"id\": 7}\n{\"id\":");
+        jsonex_pool_run(&pool, 100);
+        jsonex_pool_run(&pool, 0);
+        write_string(fds[0][1], "}\n{\"id\": 2}\n");
+        write_string(fds[1][1], " }\n");
+        close(fds[0][1]);
+        close(fds[1][1]);
+        while (!connections[0].closed || !connections[1].closed) {
+            jsonex_pool_run(&pool, 100);
+        }
+
+        char *fn = "pool";
+        CHECK_INTEGER(connections[0].records, 2);
+        CHECK_INTEGER(connections[0].id, 2);
+        CHECK_INTEGER((connections[0].error == NULL), 1);
+        CHECK_INTEGER(connections[1].records, 1);
+        CHECK_STRING(connections[1].error, "did not parse");
+
+        // The freed slot is reused for the third connection.
+        jsonex_init(&slots[0].context, connections[2].rules);
+        if (jsonex_pool_add(&pool, fds[2][0], &connections[2]) != &slots[0]) {
+            puts("jsonex_pool_add() didn't reuse a slot");
+            exit(1);
+        }
+        write_string(fds[2][1], "{\"id\": 3}");
+        close(fds[2][1]);
+        while (!connections[2].closed) {
+            jsonex_pool_run(&pool, 100);
+        }
+        CHECK_INTEGER(connections[2].records, 1);
+        CHECK_INTEGER(connections[2].id, 3);
+        CHECK_INTEGER((connections[2].error == NULL), 1);
+
+        // Nothing would empty a batch once it filled up.
+        jsonex_batch_t batch = { .columns = NULL, .capacity = 0, .rows = 0 };
+        jsonex_batch(&slots[0].context, &batch);
+        CHECK_INTEGER((jsonex_pool_add(&pool, fds[2][0], &connections[2]) == NULL), 1);
+
+        jsonex_pool_destroy(&pool);
+    }
+
+    {
+        // Strings longer than JSONEX_MAX_STRING_SIZE, streamed in chunks,
+        // some of them decoded from base64, fed in pieces of every size.
+        char *fn = "tests/10.json";
+        char buf[4096];
+        size_t len = read_file(fn, buf, sizeof(buf));
+        size_t chunks[] = { 1, 7, 64, sizeof(buf) };
+        for (int k = 0; k < 4; k++) {
+            int id = 0;
+            struct sink text = { .len = 0 }, blob = { .len = 0 }, short_blob = { .len = 0 };
+            jsonex_stream_t streams[] = {
+                { .write = sink_write, .user = &text, .base64 = 0 },
+                { .write = sink_write, .user = &blob, .base64 = 1 },
+                { .write = sink_write, .user = &short_blob, .base64 = 1 }
+            };
+            jsonex_rule_t rules[] = {
+                {
+                    .type = JSONEX_INTEGER,
+                    .p = &id,
+                    .found = NULL,
+                    .path = (char *[]){ "id", NULL }
+                },
+                {
+                    .type = JSONEX_STREAM,
+                    .p = &streams[0],
+                    .found = NULL,
+                    .path = (char *[]){ "text", NULL }
+                },
+                {
+                    .type = JSONEX_STREAM,
+                    .p = &streams[1],
+                    .found = NULL,
+                    .path = (char *[]){ "blob", NULL }
+                },
+                {
+                    .type = JSONEX_STREAM,
+                    .p = &streams[2],
+                    .found = NULL,
+                    .path = (char *[]){ "short", NULL }
+                },
+                { .type = JSONEX_NONE }
+            };
+            jsonex_context_t context;
+            jsonex_init(&context, rules);
+            for (size_t i = 0; i < len; i += chunks[k]) {
+                size_t n = len - i < chunks[k] ? len - i : chunks[k];
+                if (jsonex_feed(&context, buf + i, n) != n) {
+                    printf("jsonex_feed() failed at %zu in chunks of %zu: %s\n", i, chunks[k],
+                        jsonex_strerror(context.error));
+                    exit(1);
+                }
+            }
+            const char *ret;
+            if ((ret = jsonex_finish(&context)) != NULL) {
+                printf("jsonex_finish() during %s: %s\n", fn, ret);
+                exit(1);
+            }
+
+            CHECK_INTEGER(id, 7);
+            CHECK_INTEGER(text.ended, 1);
+            CHECK_INTEGER((int)text.len, 188);
+            if (memcmp(text.data + 180, "\"quoted\"", 8) != 0) {
+                puts("streamed text doesn't end in \"quoted\"");
+                exit(1);
+            }
+            CHECK_INTEGER(blob.ended, 1);
+            CHECK_INTEGER((int)blob.len, 512);
+            CHECK_INTEGER((int)blob.chunks, 2);
+            for (int i = 0; i < 512; i++) {
+                if ((unsigned char)blob.data[i] != i % 256) {
+                    printf("byte %i of the decoded blob is wrong\n", i);
+                    exit(1);
+                }
+            }
+            CHECK_INTEGER((int)short_blob.len, 1);
+            CHECK_INTEGER(short_blob.data[0], 'A');
+        }
+
+        // Not base64.
+        struct sink sink = { .len = 0 };
+        jsonex_stream_t stream = { .write = sink_write, .user = &sink, .base64 = 1 };
+        jsonex_rule_t rules[] = {
+            {
+                .type = JSONEX_STREAM,
+                .p = &stream,
+                .found = NULL,
+                .path = (char *[]){ "id", NULL }
+            },
+            { .type = JSONEX_NONE }
+        };
+        jsonex_context_t context;
+        jsonex_init(&context, rules);
+        const char *s = "{\"id\": \"QUJD*\"}";
+        jsonex_feed(&context, s, strlen(s));
+        CHECK_INTEGER((int)context.error_offset, 12);
+        CHECK_STRING(jsonex_finish(&context), "bad base64 in string");
+    }
+
+    {
+        // Projection: only the rules' paths are written out, minified.
+        char *fn = "tests/11.json";
+        char buf[4096];
+        size_t len = read_file(fn, buf, sizeof(buf));
+        const char *expected = "{\"id\":7,\"user\":{\"name\":\"ann \\\"a\\\"\",\"roles\":[\"x\",\"y z\"]},"
+            "\"items\":[{\"sku\":\"A1\"},{\"sku\":\"B2\"}]}";
+        int found;
+        jsonex_rule_t rules[] = {
+            {
+                .type = JSONEX_INTEGER,
+                .p = NULL,
+                .found = NULL,
+                .path = (char *[]){ "id", NULL }
+            },
+            {
+                .type = JSONEX_STRING,
+                .p = NULL,
+                .found = NULL,
+                .path = (char *[]){ "user", "name", NULL }
+            },
+            {
+                .type = JSONEX_STRING,
+                .p = NULL,
+                .found = &found,
+                .path = (char *[]){ "user", "roles", NULL }
+            },
+            {
+                .type = JSONEX_STRING,
+                .p = NULL,
+                .found = NULL,
+                .path = (char *[]){ "items", "sku", NULL }
+            },
+            { .type = JSONEX_NONE }
+        };
+        // A small buffer gets written out as it fills.
+        size_t sizes[] = { 16, 256 };
+        for (int k = 0; k < 2; k++) {
+            char out[256];
+            struct sink sink = { .len = 0 };
+            jsonex_context_t context;
+            jsonex_init(&context, rules);
+            jsonex_project(&context, out, sizes[k], sink_write, &sink);
+            if (jsonex_feed(&context, buf, len) != len || jsonex_finish(&context) != NULL) {
+                printf("projecting %s failed: %s\n", fn, jsonex_strerror(context.error));
+                exit(1);
+            }
+            sink.data[sink.len] = '\0';
+            CHECK_STRING(sink.data, expected);
+        }
+    }
+
+    {
+        // A key's backslash is escaped again, unless it starts a \uXXXX
+        // that was kept as it is.
+        char *fn = "projected keys";
+        const char *s = "{\"a\\\\u\": 1, \"\\u00e9\": 2, \"b\": 3}";
+        jsonex_rule_t rules[] = {
+            {
+                .type = JSONEX_INTEGER,
+                .p = NULL,
+                .found = NULL,
+                .path = (char *[]){ "a\\u", NULL }
+            },
+            {
+                .type = JSONEX_INTEGER,
+                .p = NULL,
+                .found = NULL,
+                .path = (char *[]){ "\\u00e9", NULL }
+            },
+            { .type = JSONEX_NONE }
+        };
+        char out[64];
+        struct sink sink = { .len = 0 };
+        jsonex_context_t context;
+        jsonex_init(&context, rules);
+        jsonex_project(&context, out, sizeof(out), sink_write, &sink);
+        CHECK_INTEGER((int)jsonex_feed(&context, s, strlen(s)), (int)strlen(s));
+        CHECK_INTEGER((jsonex_finish(&context) == NULL), 1);
+        sink.data[sink.len] = '\0';
+        CHECK_STRING(sink.data, "{\"a\\\\u\":1,\"\\u00e9\":2}");
+    }
+
+    {
+        // Projecting NDJSON, where rejected records leave nothing behind.
+        char *fn = "tests/3.ndjson";
+        int code = 0;
+        char msg[JSONEX_MAX_STRING_SIZE] = "";
+        struct records records = { .count = 0, .code = &code, .msg = msg };
+        jsonex_rule_t rules[] = {
+            {
+                .type = JSONEX_STRING,
+                .p = NULL,
+                .found = NULL,
+                .path = (char *[]){ "level", NULL },
+                .filter = JSONEX_FILTER_EQUALS,
+                .filter_string = "error"
+            },
+            {
+                .type = JSONEX_INTEGER,
+                .p = &code,
+                .found = NULL,
+                .path = (char *[]){ "code", NULL }
+            },
+            {
+                .type = JSONEX_STRING,
+                .p = msg,
+                .found = NULL,
+                .path = (char *[]){ "msg", NULL }
+            },
+            { .type = JSONEX_NONE }
+        };
+        char out[256];
+        struct sink sink = { .len = 0 };
+        jsonex_context_t context;
+        jsonex_init(&context, rules);
+        jsonex_ndjson(&context, collect_record, &records);
+        jsonex_project(&context, out, sizeof(out), sink_write, &sink);
+        run_context(&context, fn);
+        sink.data[sink.len] = '\0';
+        CHECK_INTEGER(records.count, 3);
+        CHECK_STRING(sink.data,
+            "{\"level\":\"error\",\"code\":-7,\"msg\":\"disk full\"}\n"
+            "{\"level\":\"error\",\"code\":500,\"msg\":\"out of range\"}\n"
+            "{\"level\":\"error\",\"code\":-2,\"msg\":\"eof\"}\n");
+
+        // With a filter, a record must fit in the buffer.
+        jsonex_init(&context, rules);
+        records.count = 0;
+        jsonex_ndjson(&context, collect_record, &records);
+        jsonex_project(&context, out, 16, sink_write, &sink);
+        char *s = "{\"level\":\"error\",\"code\":1,\"msg\":\"long enough\"}\n";
+        jsonex_feed(&context, s, strlen(s));
+        CHECK_STRING(jsonex_strerror(context.error), "projection output buffer full");
+    }
+
+    {
+        // Key prediction, on records that mostly share their key order. Fed
+        // one character at a time, nothing is predicted.
+        char *fn = "tests/12.ndjson";
+        char buf[4096];
+        size_t len = read_file(fn, buf, sizeof(buf));
+        size_t chunks[] = { sizeof(buf), 1 };
+        for (int k = 0; k < 2; k++) {
+            int id = 0;
+            char msg[JSONEX_MAX_STRING_SIZE] = "";
+            char name[JSONEX_MAX_STRING_SIZE] = "";
+            struct records records = { .count = 0, .code = &id, .msg = msg };
+            jsonex_rule_t rules[] = {
+                {
+                    .type = JSONEX_INTEGER,
+                    .p = &id,
+                    .found = NULL,
+                    .path = (char *[]){ "id", NULL }
+                },
+                {
+                    .type = JSONEX_STRING,
+                    .p = name,
+                    .found = NULL,
+                    .path = (char *[]){ "user", "name", NULL }
+                },
+                {
+                    .type = JSONEX_STRING,
+                    .p = msg,
+                    .found = NULL,
+                    .path = (char *[]){ "msg", NULL }
+                },
+                { .type = JSONEX_NONE }
+            };
+            jsonex_context_t context;
+            jsonex_init(&context, rules);
+            jsonex_ndjson(&context, collect_record, &records);
+            jsonex_options(&context, JSONEX_PREDICT_KEYS);
+            for (size_t i = 0; i < len; i += chunks[k]) {
+                size_t n = len - i < chunks[k] ? len - i : chunks[k];
+                if (jsonex_feed(&context, buf + i, n) != n) {
+                    printf("jsonex_feed() failed at %zu in chunks of %zu\n", i, chunks[k]);
+                    exit(1);
+                }
+            }
+            const char *ret;
+            if ((ret = jsonex_finish(&context)) != NULL) {
+                printf("jsonex_finish() during %s: %s\n", fn, ret);
+                exit(1);
+            }
+
+            CHECK_INTEGER(records.count, 5);
+            for (int i = 0; i < 5; i++) {
+                CHECK_INTEGER(records.codes[i], i + 1);
+            }
+            CHECK_STRING(records.msgs[2], "three");
+            CHECK_STRING(records.msgs[3], "four");
+            CHECK_STRING(name, "e");
+            // The first record teaches the order, the next two follow it,
+            // and the last two each go another way from their first key.
+            // Fed by the character, a key is never whole in the buffer, so
+            // only keys with nothing to predict count as misses.
+            CHECK_INTEGER((int)context.shape_hits, (k == 0 ? 12 : 0));
+            CHECK_INTEGER((int)context.shape_misses, (k == 0 ? 18 : 16));
+        }
+    }
+
+    {
+        // A key with an escape isn't learned, since it would be compared
+        // with the raw input of the next record.
+        char *fn = "escaped keys";
+        const char *s = "{\"a\\\\\": 1, \"id\": 1}\n{\"a\\\"b\": 2, \"id\": 2}\n";
+        int id = 0;
+        char msg[JSONEX_MAX_STRING_SIZE] = "";
+        struct records records = { .count = 0, .code = &id, .msg = msg };
+        jsonex_rule_t rules[] = {
+            {
+                .type = JSONEX_INTEGER,
+                .p = &id,
+                .found = NULL,
+                .path = (char *[]){ "id", NULL }
+            },
+            { .type = JSONEX_NONE }
+        };
+        jsonex_context_t context;
+        jsonex_init(&context, rules);
+        jsonex_ndjson(&context, collect_record, &records);
+        jsonex_options(&context, JSONEX_PREDICT_KEYS);
+        CHECK_INTEGER((int)jsonex_feed(&context, s, strlen(s)), (int)strlen(s));
+        CHECK_INTEGER((jsonex_finish(&context) == NULL), 1);
+        CHECK_INTEGER(records.count, 2);
+        CHECK_INTEGER(records.codes[1], 2);
+    }
+
+    {
+        // The cursor, reading what it finds rather than following rules.
+        char *fn = "tests/13.json";
+        char buf[4096];
+        size_t len = read_file(fn, buf, sizeof(buf));
+        jsonex_cursor_t cursor;
+        jsonex_cursor_init(&cursor, buf, len);
+
+        int version = 0, area = 0, filled = 0, circles = 0;
+        double radii = 0;
+        CHECK_INTEGER(jsonex_enter(&cursor), 1);
+        while (jsonex_next_token(&cursor) == JSONEX_TOKEN_KEY) {
+            if (jsonex_key_equals(&cursor, "version")) {
+                jsonex_next_token(&cursor);
+                CHECK_INTEGER(jsonex_get_int(&cursor, &version), 1);
+            } else if (jsonex_key_equals(&cursor, "shapes")) {
+                CHECK_INTEGER(jsonex_enter(&cursor), 1);
+                while (jsonex_enter(&cursor)) {
+                    int w = 0, h = 0;
+                    while (jsonex_next_token(&cursor) == JSONEX_TOKEN_KEY) {
+                        if (jsonex_key_equals(&cursor, "type")) {
+                            jsonex_next_token(&cursor);
+                            circles += strcmp(jsonex_get_string(&cursor), "circle") == 0;
+                        } else if (jsonex_key_equals(&cursor, "r")) {
+                            double r;
+                            jsonex_next_token(&cursor);
+                            CHECK_INTEGER(jsonex_get_double(&cursor, &r), 1);
+                            radii += r;
+                        } else if (jsonex_key_equals(&cursor, "w")) {
+                            jsonex_next_token(&cursor);
+                            jsonex_get_int(&cursor, &w);
+                        } else if (jsonex_key_equals(&cursor, "h")) {
+                            jsonex_next_token(&cursor);
+                            jsonex_get_int(&cursor, &h);
+                        } else if (jsonex_key_equals(&cursor, "filled")) {
+                            jsonex_next_token(&cursor);
+                            CHECK_INTEGER(jsonex_get_bool(&cursor, &filled), 1);
+                        } else {
+                            CHECK_INTEGER(jsonex_skip_value(&cursor), 1);
+                        }
+                    }
+                    CHECK_INTEGER(cursor.token, JSONEX_TOKEN_END_OBJECT);
+                    area += w * h;
+                }
+                CHECK_INTEGER(cursor.token, JSONEX_TOKEN_END_ARRAY);
+            } else {
+                CHECK_INTEGER(jsonex_enter(&cursor), 1);
+                CHECK_INTEGER(jsonex_skip_value(&cursor), 1);
+            }
+        }
+        CHECK_INTEGER(cursor.token, JSONEX_TOKEN_END_OBJECT);
+        CHECK_INTEGER(jsonex_next_token(&cursor), JSONEX_TOKEN_NONE);
+        CHECK_INTEGER(cursor.context.error, JSONEX_OK);
+        CHECK_INTEGER(version, 2);
+        CHECK_INTEGER(circles, 2);
+        CHECK_INTEGER((int)(radii * 10), 35);
+        CHECK_INTEGER(area, 12);
+        CHECK_INTEGER(filled, 1);
+
+        // Every token of a small document, and a number at the very end.
+        jsonex_token_t expected[] = {
+            JSONEX_TOKEN_BEGIN_ARRAY, JSONEX_TOKEN_STRING, JSONEX_TOKEN_BEGIN_OBJECT,
+            JSONEX_TOKEN_KEY, JSONEX_TOKEN_NUMBER, JSONEX_TOKEN_END_OBJECT,
+            JSONEX_TOKEN_FALSE, JSONEX_TOKEN_NULL, JSONEX_TOKEN_END_ARRAY, JSONEX_TOKEN_NONE
+        };
+        const char *s = "[\"a\", {\"k\": -12}, false, null]";
+        jsonex_cursor_init(&cursor, s, strlen(s));
+        for (int i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+            CHECK_INTEGER(jsonex_next_token(&cursor), expected[i]);
+            if (expected[i] == JSONEX_TOKEN_NUMBER) {
+                int k;
+                jsonex_get_int(&cursor, &k);
+                CHECK_INTEGER(k, -12);
+            }
+        }
+        s = "17";
+        int n;
+        jsonex_cursor_init(&cursor, s, strlen(s));
+        CHECK_INTEGER(jsonex_next_token(&cursor), JSONEX_TOKEN_NUMBER);
+        CHECK_INTEGER(jsonex_get_int(&cursor, &n), 1);
+        CHECK_INTEGER(n, 17);
+        CHECK_INTEGER(jsonex_next_token(&cursor), JSONEX_TOKEN_NONE);
+
+        // A container that never ends.
+        s = "{\"a\": [1, {";
+        jsonex_cursor_init(&cursor, s, strlen(s));
+        jsonex_enter(&cursor);
+        jsonex_next_token(&cursor);
+        CHECK_INTEGER(jsonex_skip_value(&cursor), 0);
+        CHECK_STRING(jsonex_strerror(cursor.context.error), "input ended inside a value");
+    }
+
+    {
+        // An index of the top-level members, then an extraction that only
+        // parses "meta".
+        char *fn = "tests/9.json";
+        FILE *json = fopen(fn, "r");
+        FILE *sidecar = tmpfile();
+        if (json == NULL || sidecar == NULL) {
+            perror("fopen");
+            exit(1);
+        }
+        const char *ret;
+        if ((ret = jsonex_index_build(json, sidecar, 1, 0)) != NULL) {
+            printf("jsonex_index_build() during %s: %s\n", fn, ret);
+            exit(1);
+        }
+        CHECK_INTEGER((int)ftell(sidecar), (int)(sizeof(jsonex_index_header_t) + 4 * sizeof(jsonex_index_entry_t)));
+
+        int id = 0, admin = 0;
+        char name[JSONEX_MAX_STRING_SIZE] = "";
+        jsonex_rule_t rules[] = {
+            {
+                .type = JSONEX_INTEGER,
+                .p = &id,
+                .found = NULL,
+                .path = (char *[]){ "meta", "id", NULL }
+            },
+            {
+                .type = JSONEX_STRING,
+                .p = name,
+                .found = NULL,
+                .path = (char *[]){ "meta", "owner", "name", NULL }
+            },
+            {
+                .type = JSONEX_BOOL,
+                .p = &admin,
+                .found = NULL,
+                .path = (char *[]){ "meta", "owner", "admin", NULL }
+            },
+            { .type = JSONEX_NONE }
+        };
+        jsonex_context_t context;
+        jsonex_init(&context, rules);
+        if ((ret = jsonex_index_extract(json, sidecar, &context)) != NULL) {
+            printf("jsonex_index_extract() during %s: %s\n", fn, ret);
+            exit(1);
+        }
+        CHECK_INTEGER(id, 42);
+        CHECK_STRING(name, "ann");
+        CHECK_INTEGER(admin, 1);
+
+        // A rule on a member the document doesn't have.
+        jsonex_rule_t missing[] = {
+            {
+                .type = JSONEX_INTEGER,
+                .p = &id,
+                .found = NULL,
+                .path = (char *[]){ "nope", "id", NULL }
+            },
+            { .type = JSONEX_NONE }
+        };
+        jsonex_init(&context, missing);
+        ret = jsonex_index_extract(json, sidecar, &context);
+        CHECK_STRING(ret, "required rule did not match");
+
+        // A filter that rejects the document, with "tail" left unparsed.
+        char tail[JSONEX_MAX_STRING_SIZE] = "";
+        jsonex_rule_t filtered[] = {
+            {
+                .type = JSONEX_INTEGER,
+                .p = &id,
+                .found = NULL,
+                .path = (char *[]){ "meta", "id", NULL },
+                .filter = JSONEX_FILTER_RANGE,
+                .filter_min = 0,
+                .filter_max = 10
+            },
+            {
+                .type = JSONEX_STRING,
+                .p = tail,
+                .found = NULL,
+                .path = (char *[]){ "tail", NULL }
+            },
+            { .type = JSONEX_NONE }
+        };
+        jsonex_init(&context, filtered);
+        ret = jsonex_index_extract(json, sidecar, &context);
+        CHECK_INTEGER((ret == NULL), 1);
+        CHECK_INTEGER(context.rejected, 1);
+        CHECK_STRING(tail, "");
+
+        jsonex_batch_t batch = { .columns = NULL, .capacity = 0, .rows = 0 };
+        jsonex_batch(&context, &batch);
+        ret = jsonex_index_extract(json, sidecar, &context);
+        CHECK_STRING(ret, "batch and cursor contexts can't be extracted into");
+        fclose(sidecar);
+        fclose(json);
+    }
+
+    {
+        // The same for NDJSON, with the members of each record grouped back
+        // together.
+        char *fn = "tests/3.ndjson";
+        FILE *json = fopen(fn, "r");
+        FILE *sidecar = tmpfile();
+        if (json == NULL || sidecar == NULL) {
+            perror("fopen");
+            exit(1);
+        }
+        const char *ret;
+        if ((ret = jsonex_index_build(json, sidecar, 1, 1)) != NULL) {
+            printf("jsonex_index_build() during %s: %s\n", fn, ret);
+            exit(1);
+        }
+
+        int code = 0;
+        char msg[JSONEX_MAX_STRING_SIZE] = "";
+        struct records records = { .count = 0, .code = &code, .msg = msg };
+        jsonex_rule_t rules[] = {
+            {
+                .type = JSONEX_INTEGER,
+                .p = &code,
+                .found = NULL,
+                .path = (char *[]){ "code", NULL }
+            },
+            {
+                .type = JSONEX_STRING,
+                .p = msg,
+                .found = NULL,
+                .path = (char *[]){ "msg", NULL }
+            },
+            { .type = JSONEX_NONE }
+        };
+        jsonex_context_t context;
+        jsonex_init(&context, rules);
+        jsonex_ndjson(&context, collect_record, &records);
+        if ((ret = jsonex_index_extract(json, sidecar, &context)) != NULL) {
+            printf("jsonex_index_extract() during %s: %s\n", fn, ret);
+            exit(1);
+        }
+        CHECK_INTEGER(records.count, 5);
+        CHECK_INTEGER(records.codes[0], 1);
+        CHECK_STRING(records.msgs[0], "x \"}\" y");
+        CHECK_INTEGER(records.codes[2], 3);
+        CHECK_STRING(records.msgs[2], "starting");
+        CHECK_INTEGER(records.codes[4], -2);
+        CHECK_STRING(records.msgs[4], "eof");
+
+        // Records rejected by a filter on "level" aren't reported, whichever
+        // of their members comes first.
+        jsonex_rule_t filtered[] = {
+            rules[0],
+            rules[1],
+            {
+                .type = JSONEX_STRING,
+                .p = NULL,
+                .found = NULL,
+                .path = (char *[]){ "level", NULL },
+                .filter = JSONEX_FILTER_EQUALS,
+                .filter_string = "error"
+            },
+            { .type = JSONEX_NONE }
+        };
+        jsonex_init(&context, filtered);
+        jsonex_ndjson(&context, collect_record, &records);
+        records.count = 0;
+        if ((ret = jsonex_index_extract(json, sidecar, &context)) != NULL) {
+            printf("jsonex_index_extract() during %s: %s\n", fn, ret);
+            exit(1);
+        }
+        CHECK_INTEGER(records.count, 3);
+        CHECK_INTEGER(records.codes[0], -7);
+        CHECK_INTEGER(records.codes[1], 500);
+        CHECK_INTEGER(records.codes[2], -2);
+        CHECK_STRING(records.msgs[2], "eof");
+        jsonex_init(&context, rules);
+        jsonex_ndjson(&context, collect_record, &records);
+
+        // Whole records, at depth 0.
+        fclose(sidecar);
+        sidecar = tmpfile();
+        if ((ret = jsonex_index_build(json, sidecar, 0, 1)) != NULL) {
+            printf("jsonex_index_build() during %s: %s\n", fn, ret);
+            exit(1);
+        }
+        CHECK_INTEGER((int)ftell(sidecar), (int)(sizeof(jsonex_index_header_t) + 5 * sizeof(jsonex_index_entry_t)));
+        records.count = 0;
+        if ((ret = jsonex_index_extract(json, sidecar, &context)) != NULL) {
+            printf("jsonex_index_extract() during %s: %s\n", fn, ret);
+            exit(1);
+        }
+        CHECK_INTEGER(records.count, 5);
+        CHECK_INTEGER(records.codes[3], 500);
+        CHECK_STRING(records.msgs[3], "out of range");
+        fclose(sidecar);
+        fclose(json);
+    }
+
     puts("success!");
 }